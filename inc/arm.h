@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#define NCPU            4
+
 /* Prevent compiler from reordering. */
 static inline void
 barrier()
@@ -28,6 +30,31 @@ timestamp()
     return t;
 }
 
+/* Wait for interrupt, which wakes up the cpu even if masked. */
+static inline void
+wfi()
+{
+    asm volatile("wfi" ::: "memory");
+}
+
+/* Wait for an event sent by sev(). */
+static inline void
+wfe()
+{
+    asm volatile("wfe" ::: "memory");
+}
+
+/*
+ * Send an event to all cpus. Prior stores are made visible first, so
+ * that a cpu woken up from wfe() never reads stale values and waits
+ * again for an event that has already been sent.
+ */
+static inline void
+sev()
+{
+    asm volatile("dsb ishst; sev" ::: "memory");
+}
+
 /* Wait n CPU cycles. */
 static inline void
 delay(uint32_t n)
@@ -123,6 +150,17 @@ relr()
     return r;
 }
 
+/* Read Fault Address Register (EL1) */
+static inline uint64_t
+rfar()
+{
+    disb();
+    uint64_t r;
+    asm volatile("mrs %[x], far_el1" : [x]"=r"(r));
+    disb();
+    return r;
+}
+
 /* Load Exception Syndrome Register (EL1) */
 static inline void
 lesr()
@@ -149,6 +187,33 @@ tlbi1()
     disb();
 }
 
+/* Invalidate all TLB entries of this core. */
+static inline void
+tlbi_local()
+{
+    disb();
+    asm volatile("tlbi vmalle1");
+    disb();
+}
+
+/* Invalidate TLB entries tagged by asid on all cores. */
+static inline void
+tlbiasid(uint64_t asid)
+{
+    disb();
+    asm volatile("tlbi aside1is, %[x]" : : [x]"r"(asid << 48));
+    disb();
+}
+
+/* Invalidate TLB entries of user virtual address va on all cores. */
+static inline void
+tlbiva(void *va)
+{
+    disb();
+    asm volatile("tlbi vaae1is, %[x]" : : [x]"r"((uint64_t)va >> 12));
+    disb();
+}
+
 /* Load Translation Table Base Register 0 (EL1) */
 static inline void
 lttbr0(uint64_t p)
@@ -158,6 +223,18 @@ lttbr0(uint64_t p)
     tlbi1();
 }
 
+/*
+ * Load Translation Table Base Register 0 (EL1) with an ASID.
+ * TLB is not flushed since entries of different ASIDs never conflict.
+ */
+static inline void
+lttbr0_asid(uint64_t p, uint64_t asid)
+{
+    disb();
+    asm volatile("msr ttbr0_el1, %[x]" : : [x]"r"(p | asid << 48));
+    isb();
+}
+
 /* Load Translation Table Base Register 1 (EL1) */
 static inline void
 lttbr1(uint64_t p)
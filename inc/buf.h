@@ -9,21 +9,32 @@
 #define B_VALID 0x2     /* Buffer has been read from disk. */
 #define B_DIRTY 0x4     /* Buffer needs to be written to disk. */
 
+#define MAXIOBLOCKS 32  /* Max blocks of one disk command. */
+#define NBATCH      8   /* Max bufs gathered on a kernel stack. */
+
+struct bio;
+
 struct buf {
     int flags;
     uint32_t dev;
     uint32_t blockno;
     uint32_t refcnt;
+    int used;       /* Referenced since the clock hand passed it. */
     uint8_t data[BSIZE];
 
     struct sleeplock lock;
-    struct list_head clink; /* LRU cache list. */
+    struct list_head clink; /* Hash bucket list. */
     struct list_head dlink; /* Disk buffer list. */
+    struct bio *bio;        /* Request it belongs to while queued. */
 };
 
 void        binit();
 void        bwrite(struct buf *b);
 void        brelse(struct buf *b);
 struct buf *bread(uint32_t dev, uint32_t blockno);
+void        bread_range(uint32_t dev, uint32_t blockno, int n, struct buf **b);
+void        bwritev(struct buf **b, int n);
+void        breadahead(uint32_t dev, uint32_t blockno, int n);
+void        bcache_dump();
 
 #endif
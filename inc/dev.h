@@ -3,8 +3,22 @@
 
 #include "buf.h"
 
+/*
+ * Buffers submitted together, which complete in any order. The bio
+ * completes when all of them have.
+ */
+struct bio {
+    int pending;                /* Buffers not completed yet. */
+    void (*done)(struct bio *); /* Called by the disk thread if set. */
+    void *arg;
+};
+
 void dev_init();
 void dev_intr();
 void devrw(struct buf *);
+void devrwv(struct buf **, int);
+void bio_init(struct bio *, void (*done)(struct bio *), void *arg);
+void submit_bio(struct bio *, struct buf **, int);
+void bio_wait(struct bio *);
 
 #endif
@@ -6,8 +6,6 @@
 #include "sleeplock.h"
 #include "fs.h"
 
-#define NFILE 100  // Open files per system
-
 struct file {
     enum { FD_NONE, FD_PIPE, FD_INODE } type;
     int ref;
@@ -15,16 +13,24 @@ struct file {
     char writable;
     struct pipe *pipe;
     struct inode *ip;
+    struct sleeplock lock;    // Protects off and readahead state
     size_t off;
+    size_t ra_off;            // Where the last read ended
+    uint32_t ra_end;          // Blocks before it are read ahead
+    uint32_t ra_win;          // Readahead window in blocks, 0 if random
 };
 
+#define RA_MIN  4             // Initial readahead window in blocks
+#define RA_MAX  128           // Max readahead window in blocks
+
 
 /* In-memory copy of an inode. */
 struct inode {
     uint32_t dev;             // Device number
     uint32_t inum;            // Inode number
     int ref;                  // Reference count
-    struct sleeplock lock;    // Protects everything below here
+    struct list_head link;    // Link in the icache
+    struct rwsleeplock lock;  // Protects everything below here
     int valid;                // Inode has been read from disk?
 
     uint16_t type;            // Copy of disk inode
@@ -53,6 +59,7 @@ struct inode *  ialloc(uint32_t, short);
 struct inode *  idup(struct inode *);
 void            iinit(int dev);
 void            ilock(struct inode *);
+void            ilock_shared(struct inode *);
 void            iput(struct inode *);
 void            iunlock(struct inode *);
 void            iunlockput(struct inode *);
@@ -62,8 +69,10 @@ struct inode *  namei(const char *);
 struct inode *  nameiparent(const char *, char *);
 void            stati(struct inode *, struct stat *);
 ssize_t         readi(struct inode *, char *, size_t, size_t);
+void            readahead(struct inode *, uint32_t, uint32_t);
 ssize_t         writei(struct inode *, char *, size_t, size_t);
 
+void            fileinit();
 struct file *   filealloc();
 struct file *   filedup(struct file *f);
 void            fileclose(struct file *f);
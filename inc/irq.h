@@ -29,9 +29,17 @@
 #endif
 
 void irq_init();
+void irq_init_cpu();
 void irq_enable(int);
 void irq_disable(int);
 void irq_register(int, void (*)());
 void irq_handler();
 
+/* Inter-processor interrupts, handled by sched_ipi(). */
+#define IPI_WAKEUP          0   /* Wake up an idle cpu. */
+#define IPI_RESCHED         1   /* Preempt the running process. */
+#define NIPI                2
+
+void ipi_send(int, int);
+
 #endif
@@ -2,11 +2,63 @@
 #define INC_MM_H
 
 #include <stddef.h>
+#include "list.h"
+#include "spinlock.h"
+
+/* Blocks of the buddy allocator are of 2^0 ~ 2^(MAX_ORDER-1) pages. */
+#define MAX_ORDER   11
+
+#define PG_BUDDY    0x1     /* Head of a free block in the buddy allocator. */
+#define PG_SLAB     0x2     /* Slab of a kmem_cache. */
+#define PG_LARGE    0x4     /* Head of a block returned by kmalloc(). */
+
+/* Physical page descriptor. */
+struct page {
+    struct list_head link;
+    int order;
+    int flags;
+    int ref;                    /* Number of page tables mapping this page. */
+
+    union {
+        /* Used if PG_SLAB is set. */
+        struct {
+            struct kmem_cache *cache;
+            void *freelist;     /* Free objects in this slab. */
+            int inuse;          /* Number of allocated objects. */
+        };
+        /* Used by user page directories, see uvm_switch(). */
+        uint64_t asid;
+    };
+};
+
+/* A cache of objects of the same size, see kern/slab.c. */
+struct kmem_cache {
+    const char *name;
+    size_t size, nobj;          /* Object size and objects per slab. */
+    struct list_head partial;   /* Slabs with free objects. */
+    struct spinlock lock;
+
+    size_t nalloc, nfree, nslab;
+    struct list_head link;      /* Link in the list of all caches. */
+};
 
 void mm_init();
 void *kalloc();
 void kfree(void *v);
+void *kalloc_pages(int order);
+void kfree_pages(void *v, int order);
+void page_get(void *v);
+void page_put(void *v);
+struct page *va2page(void *va);
+void *page2va(struct page *pg);
 void mm_test();
 void mm_dump();
 
+void slab_init();
+void kmem_cache_init(struct kmem_cache *c, const char *name, size_t size);
+void *kmem_cache_alloc(struct kmem_cache *c);
+void kmem_cache_free(struct kmem_cache *c, void *obj);
+void *kmalloc(size_t size);
+void slab_dump();
+
 #endif
@@ -37,17 +37,21 @@
 
 #define PTE_KERN        (0 << 6)
 #define PTE_USER        (1 << 6)
+#define PTE_RO          (1 << 7)        /* AP[2], read-only at both EL0 and EL1 */
 #define PTE_NG          (1 << 11)
 
+/* Bits [58:55] are reserved for software use. */
+#define PTE_COW         (1L << 55)      /* Private page shared by fork */
+
 /* 1GB/2MB block for kernel, and 4KB page for user. */
 #define PTE_KDATA       (PTE_KERN | PTE_NORMAL | PTE_BLOCK)
 #define PTE_KDEV        (PTE_KERN | PTE_DEVICE | PTE_BLOCK)
-#define PTE_UDATA       (PTE_USER | PTE_NORMAL | PTE_PAGE)
+/* User pages are non-global, i.e. tagged by ASID in TLB. */
+#define PTE_UDATA       (PTE_USER | PTE_NORMAL | PTE_PAGE | PTE_NG)
 // #define PTE_UDATA       (PTE_USER | PTE_NORMAL_NC | PTE_PAGE)
-// #define PTE_UDATA       (PTE_USER | PTE_NORMAL | PTE_PAGE | PTE_NG)
 
-/* Address in table or block entry, only support 32 bit physical address. */
-#define PTE_ADDR(pte)   ((pte) & ~0xFFF)
+/* Address in table or block entry, bits [47:12]. */
+#define PTE_ADDR(pte)   ((pte) & 0xFFFFFFFFF000)
 #define PTE_FLAGS(pte)  ((pte) &  0xFFF)
 
 /* Translation Control Register */
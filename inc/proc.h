@@ -7,10 +7,21 @@
 #include "trap.h"
 #include "spinlock.h"
 #include "list.h"
+#include "workqueue.h"
 
-#define NPROC           100
-#define NCPU            4
 #define NOFILE          16      // Open files per process
+#define NVMA            4       // File-backed segments per process
+#define NMMAP           16      // Anonymous mappings per address space
+
+/*
+ * Priority levels of run queues, 0 is the highest. SCHED_OTHER processes
+ * move among the NMLFQ levels of the multi-level feedback queue, below
+ * which is the level for SCHED_IDLE.
+ */
+#define NMLFQ           4
+#define NPRIO           (NMLFQ + 1)
+
+#define NICE_KEEP       20      // Leaves nice unchanged in sched_set()
 
 /* Stack must always be 16 bytes aligned. */
 struct context {
@@ -20,10 +31,19 @@ struct context {
     // uint64_t q0[2];             /* V0 */
 };
 
-enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+/*
+ * A segment of the executable mapped at [start, end) in user space,
+ * whose pages are read from file offset off on first touch.
+ */
+struct vma {
+    uint64_t start, end;
+    uint64_t off;
+};
 
-/* Per-process state */
-struct proc {
+/*
+ * User address space, shared by the threads created by clone(CLONE_VM).
+ */
+struct vmspace {
     /* 
      * Memory layout
      *
@@ -33,6 +53,9 @@ struct proc {
      * |  Stack   |  
      * +----------+  KERNBASE - stksz
      * |   ....   |
+     * +----------+  MMAPTOP
+     * |   Mmap   |
+     * +----------+  mmaptop
      * |   ....   |
      * +----------+  base + sz
      * |   Heap   |
@@ -42,36 +65,118 @@ struct proc {
      * | Reserved | 
      * +----------+  0
      *
+     * Pages are allocated on first touch. Those in vma[] are read from
+     * the executable exe and the others are zero-filled.
      */
     size_t base, sz;
     size_t stksz;
+    struct vma vma[NVMA];
+    int nvma;
+    struct inode *exe;
+
+    struct vma mmap[NMMAP];     /* Anonymous mappings, off is unused. */
+    int nmmap;
+    struct vma dead[NMMAP];     /* Unmapped, but not freed yet. */
+    int ndead;                  /* Counted in NMMAP with nmmap. */
+    size_t mmaptop;
 
     void *pgdir;                /* User space page table. */
+    struct spinlock lock;       /* Protects pgdir and the layout. */
+    struct seqlock layout;      /* Taken before lock to change the layout. */
+    int users;                  /* Processes not exited yet. */
+    int ref;                    /* Processes not freed yet. */
+    int nsys;                   /* Processes in a system call. */
+};
+
+/* Resource usage, see getrusage(2). */
+struct usage {
+    uint64_t utime;             /* Timer ticks spent in user mode. */
+    uint64_t stime;             /* Timer ticks spent in kernel mode. */
+    uint64_t nvcsw;             /* Switched out to sleep or exit. */
+    uint64_t nivcsw;            /* Switched out while runnable. */
+};
+
+enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+
+/* Per-process state */
+struct proc {
+    struct vmspace *vm;         /* User address space, 0 if kthread. */
     void *kstack;               /* Bottom of kernel stack for this process. */
+    struct spinlock lock;       /* Held across swtch() to/from scheduler. */
     enum procstate state;       /* Process state. */
     int pid;                    /* Process ID. */
+    int cpu;                    /* Cpu it ran on last time. */
+    uint64_t affinity;          /* Mask of cpus allowed to run on. */
+    int policy;                 /* SCHED_OTHER, SCHED_BATCH or SCHED_IDLE. */
+    int nice;                   /* -20 to 19, lower is more favorable. */
+    int level;                  /* Level of run queue to be queued. */
+    uint64_t deadline;          /* End of the current time slice. */
+    uint64_t slice;             /* Left of a slice cut short, or 0. */
+    uint64_t demotetime;        /* When level was lowered last time. */
     struct trapframe *tf;       /* Trap frame for current syscall. */
+    struct vmspace *sysvm;      /* Counts it in nsys during a syscall. */
     struct context *context;    /* swtch() here to run process. */
     struct list_head link;      /* linked list of running process. */
     void *chan;                 /* If non-zero, sleeping on chan */
+    uint64_t readytime;         /* When queued to run. */
+    int woken;                  /* Queued by wakeup rather than preempted. */
 
     struct proc *parent;        /* Parent process */
     struct list_head child;     /* Child list of this process. */
     struct list_head clink;     /* Child list of this process. */
+    struct list_head plink;     /* List of all processes. */
+    struct list_head hlink;     /* Bucket of pid hash table. */
 
     int killed;                  // If non-zero, have been killed
+    int xstate;                  // Wait status, set by exit() or killer
     struct file *ofile[NOFILE];  // Open files
     struct inode *cwd;           // Current directory
     char name[16];               // Process name (debugging)
+
+    void (*kfn)(void *);        /* Kernel thread function and argument. */
+    void *karg;
+
+    int thread;                 /* Created by clone(CLONE_THREAD)? */
+    int *clear_tid;             /* User address cleared on exit. */
+    struct work reap;           /* Frees an exited thread. */
+
+    /* Statistics, reported by wait4(), getrusage() and procdump(). */
+    struct usage ru;            /* Of this process. */
+    struct usage cru;           /* Of its waited-for children. */
+    uint64_t tstamp;            /* Last switch between user and kernel. */
+    uint64_t nmigrate;          /* Scheduled on a different cpu. */
+};
+
+/*
+ * Histogram of scheduling latency, i.e. the time from being queued to
+ * run to running, where bucket[i] counts those in [2^i, 2^(i+1)) us.
+ */
+#define NLATBUCKET      16
+struct lathist {
+    uint64_t n, total, max;     /* In timer ticks. */
+    uint64_t bucket[NLATBUCKET];
 };
 
 /* Per-CPU state */
 struct cpu {
     struct context *scheduler;  /* swtch() here to enter scheduler */
     struct proc *proc;          /* The process running on this cpu or null. */
-    struct proc *idle;          /* The idle process. */
+    volatile int level;         /* Level of proc, read by other cpus. */
     volatile int started;       /* Has the CPU started? */
-    struct spinlock lock;
+
+    struct spinlock lock;       /* Protects runq. */
+    struct list_head runq[NPRIO];   /* Runnable processes on this cpu. */
+    volatile int nrunnable;     /* Total length of runq. */
+    volatile int idle;          /* Waiting for interrupts in cpu_idle(). */
+    int resched;                /* Yield once the interrupt is handled. */
+
+    /* Statistics, reported by procdump(). */
+    uint64_t nswtch;            /* Number of processes scheduled. */
+    uint64_t nsteal;            /* Processes stolen from other cpus. */
+    uint64_t idletime;          /* Timer ticks spent in cpu_idle(). */
+    uint64_t nipi;              /* Inter-processor interrupts received. */
+    struct lathist wakelat;     /* Of processes woken up from sleep. */
+    struct lathist runlat;      /* Of processes preempted or yielded. */
 };
 
 extern struct cpu cpu[NCPU];
@@ -90,13 +195,26 @@ thisproc()
 
 void proc_init();
 void user_init();
+struct proc *kthread_create(void (*fn)(void *), void *arg, char *name,
+                            uint64_t mask);
 void scheduler();
 void sleep(void *chan, struct spinlock *lk);
 void wakeup(void *chan);
 void yield();
 void exit(int);
-int  wait();
+int  wait(int pid, int *status, int nohang, struct usage *ru);
 int  fork();
+int  clone_thread(uint64_t flags, void *stack, int *ptid, void *tls,
+                  int *ctid);
+void kill_threads(struct vmspace *vm, int xstate);
+int  futex_wait(int *uaddr, int val);
+int  futex_wake(int *uaddr, int n);
 void procdump();
+void sched_ipi(int);
+int  kill(int pid, int probe);
+int  sched_set(int pid, int policy, int nice);
+int  sched_get(int pid, int *policy, int *nice);
+int  affinity_set(int pid, uint64_t mask);
+int  affinity_get(int pid, uint64_t *mask);
 
 #endif
@@ -4,15 +4,51 @@
 #include "spinlock.h"
 #include "proc.h"
 
-/* Long-term locks for processes */
+/*
+ * Long-term locks for processes. Uncontended ones are taken and
+ * released by atomics only; lk is for waiters to sleep on.
+ */
 struct sleeplock {
     int locked;         /* Is the lock held? */
-    struct spinlock lk; /* Spinlock protecting this sleep lock */
+    int nwait;          /* Number of waiters, changed under lk */
+    struct spinlock lk; /* Spinlock protecting the waiters */
     int pid;
 };
 
-void initsleeplock(struct sleeplock *lk, char *name);
+/* Like initlock(), each call site has its own class named s. */
+#define initsleeplock(lk, s)                                    \
+({                                                              \
+    static struct lockclass __class = { .name = s };            \
+    initsleeplock1((lk), &__class);                             \
+})
+
+void initsleeplock1(struct sleeplock *lk, struct lockclass *class);
 void acquiresleep(struct sleeplock *lk);
 void releasesleep(struct sleeplock *lk);
 int holdingsleep(struct sleeplock *lk);
+
+/*
+ * Reader-writer sleep lock, held by many readers or by one writer.
+ * Waiting writers hold off new readers, so they are not starved.
+ */
+struct rwsleeplock {
+    int readers;        /* Number of readers holding it */
+    int writer;         /* Pid of the writer holding it, 0 if none */
+    int wwait;          /* Number of writers waiting */
+    struct spinlock lk; /* Spinlock protecting this lock */
+};
+
+#define initrwsleeplock(lk, s)                                  \
+({                                                              \
+    static struct lockclass __class = { .name = s };            \
+    initrwsleeplock1((lk), &__class);                           \
+})
+
+void initrwsleeplock1(struct rwsleeplock *lk, struct lockclass *class);
+void acquireread(struct rwsleeplock *lk);
+void releaseread(struct rwsleeplock *lk);
+void acquirewrite(struct rwsleeplock *lk);
+void releasewrite(struct rwsleeplock *lk);
+void downgradewrite(struct rwsleeplock *lk);
+int holdingwrite(struct rwsleeplock *lk);
 #endif
@@ -1,12 +1,106 @@
 #ifndef INC_SPINLOCK_H
 #define INC_SPINLOCK_H
 
+#include <stdint.h>
+#include "arm.h"
+
+/* Statistics of a lock class on a cpu, in timer ticks. */
+struct lockstat {
+    uint64_t nacquire;          /* Number of acquire() */
+    uint64_t ncontend;          /* Number of acquire() that had to wait */
+    uint64_t wait;              /* Time spent waiting */
+    uint64_t hold;              /* Time held */
+} __attribute__((aligned(64)));
+
+/*
+ * Locks initialized at the same place share a class, e.g. all pipes,
+ * whose statistics are reported by lock_dump().
+ */
+struct lockclass {
+    const char *name;
+    struct lockclass *next;     /* In the list of all classes. */
+    int registered;
+    struct lockstat stat[NCPU];
+};
+
+/*
+ * Ticket lock, which is granted in FIFO order. Locks never initialized
+ * by initlock(), e.g. those zero-filled, work as well but have no class.
+ */
 struct spinlock {
-    volatile int locked;
+    volatile uint16_t owner;    /* Ticket being served. */
+    volatile uint16_t next;     /* Next ticket to hand out. */
+    int cpu;                    /* Holding cpu, valid if held. */
+    uint64_t start;             /* When acquired. */
+    struct lockclass *class;
 };
-void initlock(struct spinlock *);
+
+/* Initialize lock lk, whose class is named by string literal s. */
+#define initlock(lk, s)                                         \
+({                                                              \
+    static struct lockclass __class = { .name = s };            \
+    initlock1((lk), &__class);                                  \
+})
+
+void initlock1(struct spinlock *, struct lockclass *);
 void acquire(struct spinlock *);
 void release(struct spinlock *);
+int  holding(struct spinlock *);
+void lock_dump();
+
+/*
+ * Sequence lock for data read far more often than written. Writers
+ * serialize on the spinlock and keep seq odd while writing. Readers
+ * take no lock but retry if seq changed meanwhile, so they must not
+ * hold any lock the writers take, nor trust what they read before
+ * read_seqretry() succeeds.
+ *
+ *     do {
+ *         s = read_seqbegin(sl);
+ *         ...
+ *     } while (read_seqretry(sl, s));
+ */
+struct seqlock {
+    volatile uint32_t seq;
+    struct spinlock lock;
+};
+
+#define initseqlock(sl, s)                                      \
+({                                                              \
+    (sl)->seq = 0;                                              \
+    initlock(&(sl)->lock, s);                                   \
+})
+
+static inline void
+write_seqlock(struct seqlock *sl)
+{
+    acquire(&sl->lock);
+    sl->seq++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void
+write_sequnlock(struct seqlock *sl)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    sl->seq++;
+    release(&sl->lock);
+}
+
+static inline uint32_t
+read_seqbegin(struct seqlock *sl)
+{
+    uint32_t s;
+    while ((s = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1) ;
+    return s;
+}
+
+static inline int
+read_seqretry(struct seqlock *sl, uint32_t s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return sl->seq != s;
+}
 
 #ifdef KERNLOCK
 void acquire_kern();
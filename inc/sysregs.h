@@ -41,7 +41,14 @@
 #define EC_UNKNOWN                  0x00
 #define EC_SVC64                    0x15
 #define EC_IABORT                   0x20
-#define EC_DABORT                   0x24
+#define EC_DABORT                   0x24    /* Data abort from EL0 */
+#define EC_DABORT_EL1               0x25    /* Data abort from EL1 */
+
+/* ISS of data aborts. */
+#define ISS_WNR                     (1 << 6)    /* Caused by a write */
+#define ISS_DFSC_MASK               0x3C        /* Fault status, without level */
+#define ISS_DFSC_TRANS              0x04        /* Translation fault */
+#define ISS_DFSC_PERM               0x0C        /* Permission fault */
 
 #define ISS_MASK                    0xFFFFFF
 #define IR_MASK                     (1 << 25)
@@ -1,7 +1,17 @@
 #ifndef INC_TIMER_H
 #define INC_TIMER_H
 
+#include <stdint.h>
+
+/* Time slice of a process in milliseconds, see Makefile. */
+#ifndef QUANTUM_MS
+#define QUANTUM_MS  10
+#endif
+
 void timer_init();
 void timer_intr();
+uint64_t timer_quantum();
+void timer_set(uint64_t);
+void timer_disable();
 
 #endif
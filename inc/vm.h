@@ -8,7 +8,21 @@
 uint64_t *  vm_init();
 void        vm_free(uint64_t *pgdir);
 
+struct vmspace *vmspace_alloc();
+struct vmspace *vmspace_copy(struct vmspace *vm);
+void        vmspace_exit(struct vmspace *vm);
+void        vmspace_put(struct vmspace *vm);
+
 uint64_t *  uvm_copy(uint64_t *pgdir);
+int         uvm_cow(uint64_t *pgdir, void *va);
+size_t      uvm_region(struct vmspace *vm, size_t va);
+int         uvm_fault(struct vmspace *vm, void *va);
+int         uvm_prefault(struct vmspace *vm, void *va, size_t n);
+void *      uvm_lookup(uint64_t *pgdir, void *va);
+void *      uvm_mmap(struct vmspace *vm, size_t len);
+int         uvm_munmap(struct vmspace *vm, void *va, size_t len);
+void        uvm_sysenter(struct proc *p);
+void        uvm_sysexit(struct proc *p);
 
 void        uvm_switch(uint64_t *pgdir);
 int         uvm_map(uint64_t *pgdir, void *va, size_t sz, uint64_t pa);
@@ -18,6 +32,7 @@ int         uvm_dealloc(uint64_t *pgdir, size_t base, size_t oldsz, size_t newsz
 int         copyout(uint64_t *pgdir, void *va, void *p, size_t len);
 
 void        vm_stat(uint64_t *);
+void        vm_dump();
 void        vm_test();
 
 #endif
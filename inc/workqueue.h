@@ -0,0 +1,21 @@
+#ifndef INC_WORKQUEUE_H
+#define INC_WORKQUEUE_H
+
+#include "list.h"
+
+/*
+ * Deferred work, run by fn(w) in the kernel thread of a cpu.
+ * Embed it into the structure it works on.
+ */
+struct work {
+    struct list_head link;
+    void (*fn)(struct work *);
+    int pending;                /* Queued but not started yet. */
+};
+
+void workqueue_init();
+void work_init(struct work *w, void (*fn)(struct work *));
+int  work_queue(struct work *w);
+int  work_queue_on(int cpu, struct work *w);
+
+#endif
@@ -1,12 +1,16 @@
 /* Buffer cache.
  *
- * The buffer cache is a linked list of buf structures holding
+ * The buffer cache is a hash table of buf structures holding
  * cached copies of disk block contents.  Caching disk blocks
  * in memory reduces the number of disk reads and also provides
  * a synchronization point for disk blocks used by multiple processes.
  *
  * Interface:
  * * To get a buffer for a particular disk block, call bread.
+ * * To get buffers for consecutive blocks, call bread_range,
+ *     which reads those not cached by as few commands as possible.
+ * * To start reading blocks expected to be needed soon, call
+ *     breadahead, which returns without waiting.
  * * After changing buffer data, call bwrite to write it to disk.
  * * When done with the buffer, call brelse.
  * * Do not use the buffer after calling brelse.
@@ -17,6 +21,18 @@
  * * B_VALID: the buffer data has been read from the disk.
  * * B_DIRTY: the buffer data has been modified
  *     and needs to be written to disk.
+ *
+ * Lookups only take the lock of the hash bucket, which protects
+ * the chain and refcnt of buffers in it. Misses are serialized by
+ * bcache.lock, which picks a victim by the clock algorithm: a
+ * buffer used since the hand passed it last time gets a second
+ * chance. Lock order is bcache.lock, then a bucket lock. The hand
+ * passes at most BSWEEP buffers before bcache.lock is dropped, so
+ * that other misses are not held up by a long sweep.
+ *
+ * If every buffer is referenced or dirty, a miss sleeps until
+ * brelse() drops the last reference to some buffer, which is also
+ * when a buffer written back by the log becomes clean.
  */
 
 #include "spinlock.h"
@@ -25,28 +41,157 @@
 #include "console.h"
 #include "fs.h"
 #include "dev.h"
+#include "string.h"
+#include "types.h"
+#include "mm.h"
+#include "mbox.h"
+#include "arm.h"
+#include "proc.h"
+
+/* The cache takes 1/2^BCACHE_SHIFT of memory, but no less than NBUF. */
+#define BCACHE_SHIFT    6
+
+#define BNONE           0xFFFFFFFF
+
+/* Max buffers the clock hand passes in one bvictim(). */
+#define BSWEEP          64
+
+struct bucket {
+    struct spinlock lock;
+    struct list_head head;
+};
+
+/* Per-cpu counters, updated under a bucket lock. */
+struct bstat {
+    uint64_t nhit, nmiss, nevict, nsleep, nahead;
+} __attribute__((aligned(64)));
 
 struct {
     struct spinlock lock;
-    struct buf buf[NBUF];
+    struct kmem_cache cache;
 
-    // Linked list of all buffers, through prev/next.
-    // head.next is most recently used.
-    struct list_head head;
+    struct bucket *bucket;
+    size_t nbucket;             /* Power of 2. */
+
+    struct buf **buf;           /* All buffers, swept by the clock hand. */
+    size_t nbuf, hand;
+    int nwait;                  /* Misses waiting for an unused buffer. */
+    uint64_t nput;              /* Buffers released while nwait > 0. */
+
+    struct bstat stat[NCPU];
 } bcache;
 
+static struct bucket *
+bhash(uint32_t dev, uint32_t blockno)
+{
+    uint64_t h = ((uint64_t) dev << 32 | blockno) * 0x9E3779B97F4A7C15;
+    return &bcache.bucket[(h >> 32) & (bcache.nbucket - 1)];
+}
+
 void
 binit()
 {
     struct buf *b;
 
-    // initlock(&bcache.lock, "bcache");
+    initlock(&bcache.lock, "bcache");
+    kmem_cache_init(&bcache.cache, "buf", sizeof(struct buf));
+
+    bcache.nbuf = MAX(NBUF, (mbox_get_arm_memory() >> BCACHE_SHIFT)
+                      / sizeof(struct buf));
+    for (bcache.nbucket = 1; bcache.nbucket < bcache.nbuf / 4;)
+        bcache.nbucket <<= 1;
+    bcache.bucket = kmalloc(bcache.nbucket * sizeof(struct bucket));
+    bcache.buf = kmalloc(bcache.nbuf * sizeof(struct buf *));
+    assert(bcache.bucket && bcache.buf);
+    for (size_t i = 0; i < bcache.nbucket; i++) {
+        initlock(&bcache.bucket[i].lock, "bcache.bucket");
+        list_init(&bcache.bucket[i].head);
+    }
 
-    // Create linked list of buffers
-    list_init(&bcache.head);
-    for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-        list_push_back(&bcache.head, &b->clink);
+    /* Never used buffers are unreachable, out of any bucket. */
+    for (size_t i = 0; i < bcache.nbuf; i++) {
+        b = kmem_cache_alloc(&bcache.cache);
+        assert(b);
+        memset(b, 0, sizeof(*b));
+        initsleeplock(&b->lock, "buf");
+        b->dev = b->blockno = BNONE;
+        list_init(&b->clink);
+        bcache.buf[i] = b;
+    }
+    info("%lld buffers, %lld buckets", bcache.nbuf, bcache.nbucket);
+}
+
+/* Find a cached block. The bucket lock must be held. */
+static struct buf *
+bfind(struct bucket *h, uint32_t dev, uint32_t blockno)
+{
+    struct buf *b;
+    LIST_FOREACH_ENTRY(b, &h->head, clink) {
+        if (b->dev == dev && b->blockno == blockno)
+            return b;
     }
+    return 0;
+}
+
+/* Find a cached block and reference it. The bucket lock must be held. */
+static struct buf *
+blookup(struct bucket *h, uint32_t dev, uint32_t blockno)
+{
+    struct buf *b = bfind(h, dev, blockno);
+    if (b) {
+        b->refcnt++;
+        b->used = 1;
+    }
+    return b;
+}
+
+/* Hash b, returned by bvictim(), as the block and reference it. */
+static void
+binsert(struct bucket *h, struct buf *b, uint32_t dev, uint32_t blockno)
+{
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+    b->refcnt = 1;
+    b->used = 1;
+    acquire(&h->lock);
+    list_push_back(&h->head, &b->clink);
+    bcache.stat[cpuid()].nmiss++;
+    release(&h->lock);
+}
+
+/*
+ * Take an unused buffer out of its bucket, advancing the clock hand
+ * by up to BSWEEP buffers. Return 0 if none of them is unused.
+ * Even if refcnt==0, B_DIRTY indicates a buffer is in use
+ * because log.c has modified it but not yet committed it.
+ * Caller must hold bcache.lock.
+ */
+static struct buf *
+bvictim()
+{
+    for (size_t n = 0; n < BSWEEP; n++) {
+        struct buf *b = bcache.buf[bcache.hand];
+        bcache.hand = (bcache.hand + 1) % bcache.nbuf;
+        if (b->dev == BNONE)
+            return b;
+
+        struct bucket *h = bhash(b->dev, b->blockno);
+        acquire(&h->lock);
+        if (b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
+            if (b->used) {
+                b->used = 0;
+            } else {
+                if (b->flags & B_VALID)
+                    bcache.stat[cpuid()].nevict++;
+                list_drop(&b->clink);
+                release(&h->lock);
+                return b;
+            }
+        }
+        release(&h->lock);
+    }
+    return 0;
 }
 
 /*
@@ -57,38 +202,66 @@ binit()
 static struct buf *
 bget(uint32_t dev, uint32_t blockno)
 {
+    struct bucket *h = bhash(dev, blockno);
     struct buf *b;
 
-    acquire(&bcache.lock);
-
     // Is the block already cached?
-    LIST_FOREACH_ENTRY(b, &bcache.head, clink) {
-        if (b->dev == dev && b->blockno == blockno) {
-            b->refcnt++;
-            release(&bcache.lock);
-            acquiresleep(&b->lock);
-            return b;
-        }
+    acquire(&h->lock);
+    if ((b = blookup(h, dev, blockno))) {
+        bcache.stat[cpuid()].nhit++;
+        release(&h->lock);
+        acquiresleep(&b->lock);
+        return b;
     }
+    release(&h->lock);
 
     trace("not cached: bno %d", blockno);
 
-    // Not cached; recycle an unused buffer.
-    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-    // because log.c has modified it but not yet committed it.
-    LIST_FOREACH_ENTRY_REVERSE(b, &bcache.head, clink) {
-        if (b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-            b->dev = dev;
-            b->blockno = blockno;
-            b->flags = 0;
-            b->refcnt = 1;
+    // Not cached; recycle an unused buffer unless another miss
+    // has brought the block in meanwhile. Give up only once the
+    // hand has passed every buffer twice, dropping bcache.lock
+    // after each sweep. As in acquiresleep(), a waiter counts
+    // itself in nwait before its last try, which starts over if
+    // bput() has released a buffer meanwhile.
+    int waiting = 0;
+    size_t swept = 0;
+    uint64_t nput = 0;
+    acquire(&bcache.lock);
+    for (;;) {
+        acquire(&h->lock);
+        b = blookup(h, dev, blockno);
+        release(&h->lock);
+        if (b)
+            break;
+        if ((b = bvictim())) {
+            binsert(h, b, dev, blockno);
+            break;
+        }
+        if (waiting && nput != bcache.nput) {
+            nput = bcache.nput;
+            swept = 0;
+        }
+        swept += BSWEEP;
+        if (swept < 2 * bcache.nbuf) {
             release(&bcache.lock);
-            acquiresleep(&b->lock);
-            return b;
+            acquire(&bcache.lock);
+            continue;
+        }
+        swept = 0;
+        if (waiting) {
+            bcache.stat[cpuid()].nsleep++;
+            sleep(&bcache, &bcache.lock);
+        } else {
+            waiting = 1;
+            nput = bcache.nput;
+            __atomic_add_fetch(&bcache.nwait, 1, __ATOMIC_SEQ_CST);
         }
     }
-    panic("bget: no buffers");
-    return 0;
+    if (waiting)
+        bcache.nwait--;
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
 }
 
 /* Return a locked buf with the contents of the indicated block. */
@@ -102,6 +275,109 @@ bread(uint32_t dev, uint32_t blockno)
     return b;
 }
 
+/*
+ * Return in b[] locked bufs with the contents of n consecutive blocks
+ * from blockno, taken in ascending order. n <= NBATCH.
+ */
+void
+bread_range(uint32_t dev, uint32_t blockno, int n, struct buf **b)
+{
+    struct buf *v[NBATCH];
+    int m = 0;
+
+    assert(n <= NBATCH);
+    for (int i = 0; i < n; i++) {
+        b[i] = bget(dev, blockno + i);
+        if ((b[i]->flags & B_VALID) == 0)
+            v[m++] = b[i];
+    }
+    if (m)
+        devrwv(v, m);
+}
+
+/*
+ * Like bget(), but return 0 if the block is cached already or one
+ * sweep finds no unused buffer, rather than wait.
+ */
+static struct buf *
+bget_ahead(uint32_t dev, uint32_t blockno)
+{
+    struct bucket *h = bhash(dev, blockno);
+    struct buf *b = 0;
+
+    acquire(&h->lock);
+    int cached = bfind(h, dev, blockno) != 0;
+    release(&h->lock);
+    if (cached)
+        return 0;
+
+    acquire(&bcache.lock);
+    acquire(&h->lock);
+    cached = bfind(h, dev, blockno) != 0;
+    release(&h->lock);
+    if (!cached && (b = bvictim()))
+        binsert(h, b, dev, blockno);
+    release(&bcache.lock);
+    if (!b)
+        return 0;
+
+    /* Somebody might have found and read it before we lock it. */
+    acquiresleep(&b->lock);
+    if (b->flags & B_VALID) {
+        brelse(b);
+        return 0;
+    }
+    return b;
+}
+
+struct readahead {
+    struct bio bio;
+    int n;
+    struct buf *b[MAXIOBLOCKS];
+};
+
+static void bput(struct buf *b);
+
+/* Unlock buffers read ahead, in the disk thread. */
+static void
+breadahead_done(struct bio *bio)
+{
+    struct readahead *ra = bio->arg;
+    for (int i = 0; i < ra->n; i++)
+        bput(ra->b[i]);
+    kfree(ra);
+}
+
+/*
+ * Start reading those not cached of n consecutive blocks from
+ * blockno, without waiting. n <= MAXIOBLOCKS.
+ */
+void
+breadahead(uint32_t dev, uint32_t blockno, int n)
+{
+    struct readahead *ra = 0;
+
+    assert(n <= MAXIOBLOCKS);
+    for (int i = 0; i < n; i++) {
+        struct buf *b = bget_ahead(dev, blockno + i);
+        if (!b)
+            continue;
+        if (!ra) {
+            if (!(ra = kmalloc(sizeof(*ra)))) {
+                brelse(b);
+                return;
+            }
+            ra->n = 0;
+        }
+        ra->b[ra->n++] = b;
+    }
+    if (!ra)
+        return;
+    bcache.stat[cpuid()].nahead += ra->n;
+    bio_init(&ra->bio, breadahead_done, ra);
+    submit_bio(&ra->bio, ra->b, ra->n);
+}
+
 /* Write b's contents to disk. Must be locked. */
 void
 bwrite(struct buf *b)
@@ -112,24 +388,62 @@ bwrite(struct buf *b)
     devrw(b);
 }
 
+/* Write the contents of n locked bufs to disk together. */
+void
+bwritev(struct buf **b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (!holdingsleep(&b[i]->lock))
+            panic("bwritev");
+        b[i]->flags |= B_DIRTY;
+    }
+    devrwv(b, n);
+}
+
 /*
  * Release a locked buffer.
- * Move to the head of the MRU list.
+ * It stays hashed until the clock hand recycles it.
  */
 void
 brelse(struct buf *b)
 {
     if (!holdingsleep(&b->lock))
         panic("brelse");
+    bput(b);
+}
 
+/* Unlock and release b, which might be locked by another process. */
+static void
+bput(struct buf *b)
+{
     releasesleep(&b->lock);
 
-    acquire(&bcache.lock);
-    b->refcnt--;
-    if (b->refcnt == 0) {
-        // no one is waiting for it.
-        list_drop(&b->clink);
-        list_push_back(&bcache.head, &b->clink);
+    struct bucket *h = bhash(b->dev, b->blockno);
+    acquire(&h->lock);
+    int unused = --b->refcnt == 0;
+    release(&h->lock);
+
+    if (unused && __atomic_load_n(&bcache.nwait, __ATOMIC_SEQ_CST)) {
+        acquire(&bcache.lock);
+        bcache.nput++;
+        wakeup(&bcache);
+        release(&bcache.lock);
     }
-    release(&bcache.lock);
+}
+
+/* Print statistics of the buffer cache. */
+void
+bcache_dump()
+{
+    struct bstat t = { 0 };
+    for (int i = 0; i < NCPU; i++) {
+        t.nhit += bcache.stat[i].nhit;
+        t.nmiss += bcache.stat[i].nmiss;
+        t.nevict += bcache.stat[i].nevict;
+        t.nsleep += bcache.stat[i].nsleep;
+        t.nahead += bcache.stat[i].nahead;
+    }
+    cprintf("bcache: %lld buffers, %lld hits, %lld misses, "
+            "%lld evictions, %lld sleeps, %lld read ahead\n", bcache.nbuf,
+            t.nhit, t.nmiss, t.nevict, t.nsleep, t.nahead);
 }
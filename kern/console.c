@@ -9,6 +9,8 @@
 #include "spinlock.h"
 #include "file.h"
 #include "mm.h"
+#include "vm.h"
+#include "buf.h"
 
 #define CONSOLE 1
 
@@ -132,7 +134,10 @@ console_intr1(int (*getc)())
 
     if (prof) {
         mm_dump();
+        vm_dump();
         procdump();
+        lock_dump();
+        bcache_dump();
     }
 }
 
@@ -145,6 +150,8 @@ console_intr()
 void
 console_init()
 {
+    initlock(&conslock, "console");
+    initlock(&dbglock, "debug");
     uart_init();
 
     irq_enable(IRQ_AUX);
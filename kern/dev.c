@@ -9,13 +9,20 @@
 #include "proc.h"
 #include "console.h"
 #include "dev.h"
+#include "mm.h"
 
 static void dev_test();
 
 static struct emmc card;
 static struct list_head devque;
+/* Protects devque, bio->pending and their wakeups. */
+static struct spinlock devlock;
+/* Held across commands, so that queuing never waits on the card. */
 static struct spinlock cardlock;
 
+/* Adjacent blocks are transferred by one command through it. */
+static uint8_t *bounce;
+
 // Hack the partition.
 static uint32_t first_bno = 0;
 static uint32_t nblocks = 1;
@@ -26,6 +33,23 @@ dev_sleep(void *chan)
     sleep(chan, &cardlock);
 }
 
+static void dev_start();
+
+/*
+ * The disk thread serves devque, so that submitters need not wait.
+ * With sdhost, it sleeps on the card until woken up by dev_intr().
+ */
+static void
+dev_thread(void *arg)
+{
+    acquire(&devlock);
+    for (;;) {
+        while (list_empty(&devque))
+            sleep(&devque, &devlock);
+        dev_start();
+    }
+}
+
 /*
  * Initialize SD card and parse MBR.
  * 1. The first partition should be FAT and is used for booting.
@@ -37,7 +61,12 @@ void
 dev_init()
 {
     list_init(&devque);
-    initlock(&cardlock);
+    initlock(&devlock, "devque");
+    initlock(&cardlock, "card");
+    bounce = kmalloc(MAXIOBLOCKS * BSIZE);
+    assert(bounce);
+    struct proc *p = kthread_create(dev_thread, 0, "disk", (1 << NCPU) - 1);
+    assert(p);
 
 #if RASPI == 3
     irq_enable(IRQ_SDIO);
@@ -72,53 +101,141 @@ dev_intr()
 }
 
 /*
- * Start all request.
- * Caller must hold sdlock.
+ * Pop a request from the queue into b[], i.e. the front buffer and
+ * those following it in both the queue and the disk, in the same
+ * direction. Return the number of buffers.
+ * Caller must hold devlock.
  */
-void
+static int
+dev_request(struct buf **b)
+{
+    int n = 0;
+    do {
+        b[n] = container_of(list_front(&devque), struct buf, dlink);
+        list_pop_front(&devque);
+        n++;
+        if (n == MAXIOBLOCKS || list_empty(&devque))
+            break;
+        struct buf *nb =
+            container_of(list_front(&devque), struct buf, dlink);
+        if (nb->blockno != b[n - 1]->blockno + 1
+            || (nb->flags & B_DIRTY) != (b[0]->flags & B_DIRTY))
+            break;
+    } while (1);
+    return n;
+}
+
+/*
+ * Serve all requests and complete their bios.
+ * Caller must hold devlock, which is dropped during each transfer,
+ * done with only cardlock held, and to call bio->done.
+ * Only the disk thread calls it, so b[] is kept off its stack.
+ */
+static void
 dev_start()
 {
+    static struct buf *b[MAXIOBLOCKS];
+
     while (!list_empty(&devque)) {
-        struct buf *b =
-            container_of(list_front(&devque), struct buf, dlink);
-        assert(b->blockno < nblocks);
-        uint32_t bno = b->blockno + first_bno;
+        int n = dev_request(b);
+        int write = b[0]->flags & B_DIRTY;
+        size_t cnt = n * BSIZE;
+        uint8_t *data = n == 1 ? b[0]->data : bounce;
+        assert(b[n - 1]->blockno < nblocks);
+        uint32_t bno = b[0]->blockno + first_bno;
 
-        emmc_seek(&card, bno * BSIZE);
-        if (b->flags & B_DIRTY) {
-            assert(emmc_write(&card, b->data, BSIZE) == BSIZE);
+        release(&devlock);
+        acquire(&cardlock);
+        emmc_seek(&card, (uint64_t) bno * BSIZE);
+        if (write) {
+            for (int i = 0; n > 1 && i < n; i++)
+                memmove(bounce + i * BSIZE, b[i]->data, BSIZE);
+            assert(emmc_write(&card, data, cnt) == cnt);
         } else {
-            assert(emmc_read(&card, b->data, BSIZE) == BSIZE);
+            assert(emmc_read(&card, data, cnt) == cnt);
+            for (int i = 0; n > 1 && i < n; i++)
+                memmove(b[i]->data, bounce + i * BSIZE, BSIZE);
         }
+        release(&cardlock);
+        acquire(&devlock);
 
-        b->flags |= B_VALID;
-        b->flags &= ~B_DIRTY;
-
-        list_pop_front(&devque);
+        for (int i = 0; i < n; i++) {
+            b[i]->flags |= B_VALID;
+            b[i]->flags &= ~B_DIRTY;
+        }
 
         disb();
-        wakeup(b);
+        for (int i = 0; i < n; i++) {
+            struct bio *bio = b[i]->bio;
+            b[i]->bio = 0;
+            if (--bio->pending)
+                continue;
+            if (bio->done) {
+                release(&devlock);
+                bio->done(bio);
+                acquire(&devlock);
+            } else {
+                wakeup(bio);
+            }
+        }
     }
 }
 
+/*
+ * Initialize a bio. If done is not null, the disk thread calls
+ * done(bio) when it completes, and nobody may wait for it.
+ */
 void
-devrw(struct buf *b)
+bio_init(struct bio *bio, void (*done)(struct bio *), void *arg)
 {
-    acquire(&cardlock);
-
-    /* Append to request queue. */
-    list_push_back(&devque, &b->dlink);
+    bio->pending = 0;
+    bio->done = done;
+    bio->arg = arg;
+}
 
-    /* Start disk if necessary. */
-    if (list_front(&devque) == &b->dlink) {
-        dev_start();
+/*
+ * Queue n locked buffers as bio, each to be read or written by its
+ * B_DIRTY flag, and return without waiting. Those of adjacent blocks
+ * in b[] are merged into one command.
+ */
+void
+submit_bio(struct bio *bio, struct buf **b, int n)
+{
+    assert(n > 0);
+    acquire(&devlock);
+    bio->pending = n;
+    for (int i = 0; i < n; i++) {
+        b[i]->bio = bio;
+        list_push_back(&devque, &b[i]->dlink);
     }
+    wakeup(&devque);
+    release(&devlock);
+}
 
-    /* Wait for request to finish. */
-    while ((b->flags & (B_VALID | B_DIRTY)) != B_VALID)
-        dev_sleep(b);
+/* Wait until all buffers of bio complete. */
+void
+bio_wait(struct bio *bio)
+{
+    acquire(&devlock);
+    while (bio->pending)
+        sleep(bio, &devlock);
+    release(&devlock);
+}
 
-    release(&cardlock);
+/* Read or write n buffers and wait for all of them. */
+void
+devrwv(struct buf **b, int n)
+{
+    struct bio bio;
+    bio_init(&bio, 0, 0);
+    submit_bio(&bio, b, n);
+    bio_wait(&bio);
+}
+
+void
+devrw(struct buf *b)
+{
+    devrwv(&b, 1);
 }
 
 /* Test SD card read/write speed. */
@@ -190,5 +307,28 @@ dev_test()
 
     info("write %lldB (%lldMB), t: %lld cycles, speed: %lld.%lld MB/s\n",
          n * BSIZE, mb, t, mb * f / t, (mb * f * 10 / t) % 10);
+
+    // Both again with multi-block commands
+    static struct buf *v[MAXIOBLOCKS];
+    for (int write = 0; write < 2; write++) {
+        disb();
+        t = timestamp();
+        disb();
+        for (int i = 0; i < n; i += MAXIOBLOCKS) {
+            for (int j = 0; j < MAXIOBLOCKS; j++) {
+                v[j] = &b[i + j];
+                v[j]->flags = write ? B_DIRTY : 0;
+                v[j]->blockno = i + j;
+            }
+            devrwv(v, MAXIOBLOCKS);
+        }
+        disb();
+        t = timestamp() - t;
+        disb();
+        info("%s %lldB (%lldMB) by %d blocks, t: %lld cycles, "
+             "speed: %lld.%lld MB/s", write ? "write" : "read",
+             n * BSIZE, mb, MAXIOBLOCKS, t, mb * f / t,
+             (mb * f * 10 / t) % 10);
+    }
 #endif
 }
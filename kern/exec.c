@@ -21,12 +21,13 @@ execve(const char *path, char *const argv[], char *const envp[])
     if (fetchstr((uint64_t) path, &s) < 0)
         return -1;
 
-    // Save previous page table.
+    // Save previous address space.
     struct proc *curproc = thisproc();
-    void *oldpgdir = curproc->pgdir, *pgdir = vm_init();
-    struct inode *ip = 0;
+    struct vmspace *oldvm = curproc->vm, *vm = vmspace_alloc();
+    void *oldpgdir = oldvm->pgdir, *pgdir = vm ? vm->pgdir : 0;
+    struct inode *ip = 0, *exe = 0;
 
-    if (pgdir == 0) {
+    if (vm == 0) {
         debug("vm init failed");
         goto bad;
     }
@@ -40,7 +41,7 @@ execve(const char *path, char *const argv[], char *const envp[])
         debug("namei bad");
         goto bad;
     }
-    ilock(ip);
+    ilock_shared(ip);
 
     Elf64_Ehdr elf;
     if (readi(ip, (char *)&elf, 0, sizeof(elf)) != sizeof(elf)) {
@@ -64,9 +65,9 @@ execve(const char *path, char *const argv[], char *const envp[])
     uint64_t off;
     Elf64_Phdr ph;
 
-    curproc->pgdir = pgdir;     // Required since readi(sdrw) involves context switch(switch page table).
-
-    // Load program into memory.
+    // Record file segments, which will be loaded on first touch.
+    struct vma vma[NVMA];
+    int nvma = 0;
     size_t sz = 0, base = 0, stksz = 0;
     int first = 1;
     for (i = 0, off = elf.e_phoff; i < elf.e_phnum; i++, off += sizeof(ph)) {
@@ -99,31 +100,30 @@ execve(const char *path, char *const argv[], char *const envp[])
             }
         }
 
-        if ((sz =
-             uvm_alloc(pgdir, base, stksz, sz,
-                       ph.p_vaddr + ph.p_memsz)) == 0) {
-            debug("uvm_alloc bad");
+        if (ph.p_vaddr < sz || ph.p_vaddr + ph.p_memsz >= USERTOP) {
+            debug("segments overlapped or out of user space");
             goto bad;
         }
+        sz = ph.p_vaddr + ph.p_memsz;
 
-        uvm_switch(pgdir);
-
-        if (readi(ip, (char *)ph.p_vaddr, ph.p_offset, ph.p_filesz) !=
-            ph.p_filesz) {
-            debug("read section bad");
-            goto bad;
+        // BSS is zero-filled on demand.
+        if (ph.p_filesz) {
+            if (nvma == NVMA) {
+                debug("too many segments");
+                goto bad;
+            }
+            vma[nvma].start = ph.p_vaddr;
+            vma[nvma].end = ph.p_vaddr + ph.p_filesz;
+            vma[nvma].off = ph.p_offset;
+            nvma++;
         }
-        // Initialize BSS.
-        memset((void *)ph.p_vaddr + ph.p_filesz, 0,
-               ph.p_memsz - ph.p_filesz);
-
-        // Flush dcache to memory so that icache can retrieve the correct one.
-        dccivac(ph.p_vaddr, ph.p_memsz);
-
-        trace("init bss [0x%p, 0x%p)", ph.p_vaddr + ph.p_filesz,
+        trace("segment [0x%p, 0x%p), bss [0x%p, 0x%p)", ph.p_vaddr,
+              ph.p_vaddr + ph.p_filesz, ph.p_vaddr + ph.p_filesz,
               ph.p_vaddr + ph.p_memsz);
     }
 
+    // Keep a reference to the executable for demand paging.
+    exe = idup(ip);
     iunlockput(ip);
     end_op();
     ip = 0;
@@ -134,8 +134,9 @@ execve(const char *path, char *const argv[], char *const envp[])
     int argc = 0, envc = 0;
     size_t len;
     if (argv) {
-        for (; in_user((void *)(argv + argc), sizeof(*argv)) && argv[argc];
-             argc++) {
+        for (; in_user((void *)(argv + argc), sizeof(*argv))
+             && uvm_prefault(oldvm, (void *)(argv + argc), sizeof(*argv)) == 0
+             && argv[argc]; argc++) {
             if ((len = fetchstr((uint64_t) argv[argc], &s)) < 0) {
                 debug("argv fetchstr bad");
                 goto bad;
@@ -147,8 +148,9 @@ execve(const char *path, char *const argv[], char *const envp[])
         }
     }
     if (envp) {
-        for (; in_user((void *)(envp + envc), sizeof(*envp)) && envp[envc];
-             envc++) {
+        for (; in_user((void *)(envp + envc), sizeof(*envp))
+             && uvm_prefault(oldvm, (void *)(envp + envc), sizeof(*envp)) == 0
+             && envp[envc]; envc++) {
             if ((len = fetchstr((uint64_t) envp[envc], &s)) < 0) {
                 debug("envp fetchstr bad");
                 goto bad;
@@ -189,21 +191,24 @@ execve(const char *path, char *const argv[], char *const envp[])
     sp = newsp;
     trace("newsp: 0x%p", sp);
 
-    // Allocate user stack.
+    // Reserve user stack, which is zero-filled on demand.
     stksz = ROUNDUP(USERTOP - (size_t)sp, 10 * PGSIZE);
-    if (copyout
-        (pgdir, (void *)(USERTOP - stksz), 0,
-         stksz - (USERTOP - (size_t)sp)) < 0)
+    if (sz >= USERTOP - stksz) {
+        debug("no space for user stack");
         goto bad;
+    }
 
     assert((uint64_t) sp > USERTOP - stksz);
 
     // Commit to the user image.
-    curproc->pgdir = pgdir;
-
-    curproc->base = base;
-    curproc->sz = sz;
-    curproc->stksz = stksz;
+    vm->base = base;
+    vm->sz = sz;
+    vm->stksz = stksz;
+    memmove(vm->vma, vma, sizeof(vma));
+    vm->nvma = nvma;
+    vm->exe = exe;
+    curproc->vm = vm;
+    curproc->clear_tid = 0;
 
     // memset(curproc->tf, 0, sizeof(*curproc->tf));
 
@@ -221,17 +226,34 @@ execve(const char *path, char *const argv[], char *const envp[])
             last = cur + 1;
     safestrcpy(curproc->name, last, sizeof(curproc->name));
 
-    uvm_switch(curproc->pgdir);
-    vm_free(oldpgdir);
+    uvm_switch(pgdir);
+
+    // Other threads die with the old image.
+    if (oldvm->ref > 1)
+        kill_threads(oldvm, 9 /* SIGKILL */);
+    uvm_sysexit(curproc);
+    begin_op();
+    vmspace_exit(oldvm);
+    end_op();
+    vmspace_put(oldvm);
     trace("finish %s", curproc->name);
     return 0;
 
   bad:
-    if (pgdir)
-        vm_free(pgdir);
+    uvm_switch(oldpgdir);
     if (ip)
         iunlockput(ip), end_op();
-    thisproc()->pgdir = oldpgdir;
+    if (vm) {
+        begin_op();
+        vm->exe = exe;
+        vmspace_exit(vm);
+        end_op();
+        vmspace_put(vm);
+    } else if (exe) {
+        begin_op();
+        iput(exe);
+        end_op();
+    }
     debug("bad");
     return -1;
 }
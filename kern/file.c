@@ -7,36 +7,33 @@
 #include "file.h"
 #include "console.h"
 #include "log.h"
+#include "string.h"
+#include "mm.h"
 
 struct devsw devsw[NDEV];
 struct {
-    struct spinlock lock;
-    struct file file[NFILE];
+    struct spinlock lock;       /* Protects ref of all files. */
+    struct kmem_cache cache;
 } ftable;
 
-/* Optional since BSS is zero-initialized. */
 void
 fileinit()
 {
-    initlock(&ftable.lock);
+    initlock(&ftable.lock, "ftable");
+    kmem_cache_init(&ftable.cache, "file", sizeof(struct file));
 }
 
 /* Allocate a file structure. */
 struct file *
 filealloc()
 {
-    struct file *f;
-
-    acquire(&ftable.lock);
-    for (f = ftable.file; f < ftable.file + NFILE; f++) {
-        if (f->ref == 0) {
-            f->ref = 1;
-            release(&ftable.lock);
-            return f;
-        }
+    struct file *f = kmem_cache_alloc(&ftable.cache);
+    if (f) {
+        memset(f, 0, sizeof(*f));
+        f->ref = 1;
+        initsleeplock(&f->lock, "file");
     }
-    release(&ftable.lock);
-    return 0;
+    return f;
 }
 
 /* Increment ref count for file f. */
@@ -65,9 +62,8 @@ fileclose(struct file *f)
         return;
     }
     ff = *f;
-    f->ref = 0;
-    f->type = FD_NONE;
     release(&ftable.lock);
+    kmem_cache_free(&ftable.cache, f);
 
     if (ff.type == FD_PIPE)
         pipeclose(ff.pipe, ff.writable);
@@ -83,7 +79,7 @@ int
 filestat(struct file *f, struct stat *st)
 {
     if (f->type == FD_INODE) {
-        ilock(f->ip);
+        ilock_shared(f->ip);
         stati(f->ip, st);
         iunlock(f->ip);
         return 0;
@@ -91,6 +87,35 @@ filestat(struct file *f, struct stat *st)
     return -1;
 }
 
+/*
+ * Read ahead of a read of n bytes at off from f, if it continues
+ * the last one. The window grows by the blocks each sequential read
+ * finishes, up to a few times the size of the read, so that small
+ * reads do not fill the cache. More blocks are read ahead once the
+ * reader is halfway through the window.
+ * Caller must hold f->lock and f->ip->lock.
+ */
+static void
+file_readahead(struct file *f, size_t off, size_t n)
+{
+    if (off != f->ra_off) {
+        f->ra_end = f->ra_win = 0;
+        f->ra_off = off + n;
+        return;
+    }
+    f->ra_off = off + n;
+    uint32_t used = f->ra_off / BSIZE - off / BSIZE;
+    uint32_t cap = MIN(RA_MAX, MAX(RA_MIN, 4 * ((n + BSIZE - 1) / BSIZE)));
+    f->ra_win = MIN(f->ra_win ? f->ra_win + used : RA_MIN, cap);
+
+    uint32_t bn = f->ra_off / BSIZE;
+    if (bn + f->ra_win / 2 < f->ra_end)
+        return;
+    uint32_t start = MAX(bn, f->ra_end);
+    f->ra_end = bn + f->ra_win;
+    readahead(f->ip, start, f->ra_end - start);
+}
+
 /* Read from file f. */
 ssize_t
 fileread(struct file *f, char *addr, ssize_t n)
@@ -102,10 +127,19 @@ fileread(struct file *f, char *addr, ssize_t n)
     if (f->type == FD_PIPE)
         return piperead(f->pipe, addr, n);
     if (f->type == FD_INODE) {
-        ilock(f->ip);
-        if ((r = readi(f->ip, addr, f->off, n)) > 0)
+        /* Readers of different files can go in parallel. */
+        int seek = f->ip->type != T_DEV;
+        if (seek)
+            acquiresleep(&f->lock);
+        ilock_shared(f->ip);
+        if ((r = readi(f->ip, addr, f->off, n)) > 0) {
+            if (seek)
+                file_readahead(f, f->off, r);
             f->off += r;
+        }
         iunlock(f->ip);
+        if (seek)
+            releasesleep(&f->lock);
         return r;
     }
     panic("fileread");
@@ -133,6 +167,9 @@ filewrite(struct file *f, char *addr, ssize_t n)
          */
         ssize_t max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * 512;
         ssize_t i = 0;
+        int seek = f->ip->type != T_DEV;
+        if (seek)
+            acquiresleep(&f->lock);
         while (i < n) {
             ssize_t n1 = n - i;
             if (n1 > max)
@@ -151,6 +188,8 @@ filewrite(struct file *f, char *addr, ssize_t n)
                 panic("short filewrite");
             i += r;
         }
+        if (seek)
+            releasesleep(&f->lock);
         return i == n ? n : -1;
     }
     panic("filewrite");
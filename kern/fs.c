@@ -23,6 +23,7 @@
 #include "buf.h"
 #include "log.h"
 #include "file.h"
+#include "mm.h"
 
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -162,29 +163,31 @@ bfree(int dev, uint32_t b)
  * multi-step atomic operations.
  *
  * The icache.lock spin-lock protects the allocation of icache
- * entries. Since ip->ref indicates whether an entry is free,
- * and ip->dev and ip->inum indicate which i-node an entry
- * holds, one must hold icache.lock while using any of those fields.
+ * entries. An entry is allocated from the inode kmem_cache by iget()
+ * and freed once its ip->ref drops to zero. Since ip->dev and ip->inum
+ * indicate which i-node an entry holds, one must hold icache.lock
+ * while using any of ip->ref, ip->dev and ip->inum.
  *
  * An ip->lock sleep-lock protects all ip-> fields other than ref,
  * dev, and inum.  One must hold ip->lock in order to
  * read or write that inode's ip->valid, ip->size, ip->type, &c.
+ * It is a reader-writer lock: those only reading the inode and its
+ * content, e.g. readi() and dirlookup(), may lock it shared by
+ * ilock_shared(), while modifications need ilock().
  */
 
 struct {
     struct spinlock lock;
-    struct inode inode[NINODE];
+    struct list_head inuse;     /* Inodes with positive ref. */
+    struct kmem_cache cache;
 } icache;
 
 void
 iinit(int dev)
 {
-    int i = 0;
-
-    initlock(&icache.lock);
-    for (i = 0; i < NINODE; i++) {
-        initsleeplock(&icache.inode[i].lock, "inode");
-    }
+    initlock(&icache.lock, "icache");
+    list_init(&icache.inuse);
+    kmem_cache_init(&icache.cache, "inode", sizeof(struct inode));
 
     readsb(dev, &sb);
     info("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
@@ -253,27 +256,25 @@ iupdate(struct inode *ip)
 static struct inode *
 iget(uint32_t dev, uint32_t inum)
 {
-    struct inode *ip, *empty;
+    struct inode *ip;
 
     acquire(&icache.lock);
 
     // Is the inode already cached?
-    empty = 0;
-    for (ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++) {
-        if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
+    LIST_FOREACH_ENTRY(ip, &icache.inuse, link) {
+        if (ip->dev == dev && ip->inum == inum) {
             ip->ref++;
             release(&icache.lock);
             return ip;
         }
-        if (empty == 0 && ip->ref == 0) // Remember empty slot.
-            empty = ip;
     }
 
-    // Recycle an inode cache entry.
-    if (empty == 0)
+    // Allocate a new inode cache entry.
+    if ((ip = kmem_cache_alloc(&icache.cache)) == 0)
         panic("iget: no inodes");
 
-    ip = empty;
+    initrwsleeplock(&ip->lock, "inode");
+    list_push_back(&icache.inuse, &ip->link);
     ip->dev = dev;
     ip->inum = inum;
     ip->ref = 1;
@@ -297,7 +298,7 @@ idup(struct inode *ip)
 }
 
 /* 
- * Lock the given inode.
+ * Lock the given inode exclusively.
  * Reads the inode from disk if necessary.
  */
 void
@@ -309,7 +310,7 @@ ilock(struct inode *ip)
     if (ip == 0 || ip->ref < 1)
         panic("ilock");
 
-    acquiresleep(&ip->lock);
+    acquirewrite(&ip->lock);
 
     if (ip->valid == 0) {
         bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -327,14 +328,36 @@ ilock(struct inode *ip)
     }
 }
 
-/* Unlock the given inode. */
+/*
+ * Lock the given inode shared with other readers, for those only
+ * reading it, e.g. by readi() or dirlookup().
+ */
+void
+ilock_shared(struct inode *ip)
+{
+    if (ip == 0 || ip->ref < 1)
+        panic("ilock_shared");
+
+    acquireread(&ip->lock);
+    if (ip->valid == 0) {
+        /* Read it from disk exclusively. */
+        releaseread(&ip->lock);
+        ilock(ip);
+        downgradewrite(&ip->lock);
+    }
+}
+
+/* Unlock the given inode, locked either exclusively or shared. */
 void
 iunlock(struct inode *ip)
 {
-    if (ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
+    if (ip == 0 || ip->ref < 1)
         panic("iunlock");
 
-    releasesleep(&ip->lock);
+    if (holdingwrite(&ip->lock))
+        releasewrite(&ip->lock);
+    else
+        releaseread(&ip->lock);
 }
 
 /* Drop a reference to an in-memory inode.
@@ -349,7 +372,7 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-    acquiresleep(&ip->lock);
+    acquirewrite(&ip->lock);
     if (ip->valid && ip->nlink == 0) {
         acquire(&icache.lock);
         int r = ip->ref;
@@ -362,10 +385,13 @@ iput(struct inode *ip)
             ip->valid = 0;
         }
     }
-    releasesleep(&ip->lock);
+    releasewrite(&ip->lock);
 
     acquire(&icache.lock);
-    ip->ref--;
+    if (--ip->ref == 0) {
+        list_drop(&ip->link);
+        kmem_cache_free(&icache.cache, ip);
+    }
     release(&icache.lock);
 }
 
@@ -487,7 +513,7 @@ ssize_t
 readi(struct inode *ip, char *dst, size_t off, size_t n)
 {
     size_t tot, m;
-    struct buf *bp;
+    struct buf *bp[NBATCH];
 
     if (ip->type == T_DEV) {
         if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
@@ -500,16 +526,49 @@ readi(struct inode *ip, char *dst, size_t off, size_t n)
     if (off + n > ip->size)
         n = ip->size - off;
 
-    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-        bp = bread(ip->dev, bmap(ip, off / BSIZE));
-        m = min(n - tot, BSIZE - off % BSIZE);
-        memmove(dst, bp->data + off % BSIZE, m);
-        brelse(bp);
+    for (tot = 0; tot < n;) {
+        // Read the following blocks contiguous on disk together.
+        uint32_t bn = (off + tot) / BSIZE, end = (off + n - 1) / BSIZE;
+        uint32_t addr = bmap(ip, bn);
+        int cnt = 1;
+        while (cnt < NBATCH && bn + cnt <= end
+               && bmap(ip, bn + cnt) == addr + cnt)
+            cnt++;
+
+        bread_range(ip->dev, addr, cnt, bp);
+        for (int i = 0; i < cnt; i++) {
+            m = min(n - tot, BSIZE - (off + tot) % BSIZE);
+            memmove(dst + tot, bp[i]->data + (off + tot) % BSIZE, m);
+            tot += m;
+            brelse(bp[i]);
+        }
     }
 
     return n;
 }
 
+/*
+ * Start reading n blocks of ip from block bn into the buffer cache,
+ * stopping at the end of file, without waiting.
+ * Caller must hold ip->lock.
+ */
+void
+readahead(struct inode *ip, uint32_t bn, uint32_t n)
+{
+    if (ip->type == T_DEV)
+        return;
+    uint32_t end = MIN(bn + n, (ip->size + BSIZE - 1) / BSIZE);
+    while (bn < end) {
+        uint32_t addr = bmap(ip, bn);
+        int cnt = 1;
+        while (cnt < MAXIOBLOCKS && bn + cnt < end
+               && bmap(ip, bn + cnt) == addr + cnt)
+            cnt++;
+        breadahead(ip->dev, addr, cnt);
+        bn += cnt;
+    }
+}
+
 /*
  * Write data to inode.
  * Caller must hold ip->lock.
@@ -671,7 +730,7 @@ namex(const char *path, int nameiparent, char *name)
         ip = idup(thisproc()->cwd);
 
     while ((path = skipelem(path, name)) != 0) {
-        ilock(ip);
+        ilock_shared(ip);
         if (ip->type != T_DIR) {
             iunlockput(ip);
             return 0;
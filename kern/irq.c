@@ -9,6 +9,7 @@
 #include "timer.h"
 #include "clock.h"
 #include "console.h"
+#include "proc.h"
 
 #define IRQ_BASIC_PENDING       (MMIO_BASE + 0xB200)
 #define IRQ_PENDING_1           (MMIO_BASE + 0xB204)
@@ -50,9 +51,16 @@
 #define GPU_IRQ2CORE(i)         ((i) << 4)
 #endif
 
+/* Core mailboxes, mailbox 0 of each core is used for IPI. */
+#define MBOX_INT_CTRL(i)        (LOCAL_BASE + 0x50 + 4*(i))
+#define MBOX_INT_MBOX0          (1 << 0)
+#define MBOX_SET(i, n)          (LOCAL_BASE + 0x80 + 0x10*(i) + 4*(n))
+#define MBOX_CLR(i, n)          (LOCAL_BASE + 0xC0 + 0x10*(i) + 4*(n))
+
 #define IRQ_SRC_CORE(i)         (LOCAL_BASE + 0x60 + 4*(i))
 #define IRQ_SRC_TIMER           (1 << 11)       /* Local Timer */
 #define IRQ_SRC_GPU             (1 << 8)
+#define IRQ_SRC_MBOX0           (1 << 4)
 #define IRQ_SRC_CNTPNSIRQ       (1 << 1)        /* Core Timer */
 #define FIQ_SRC_CORE(i)         (LOCAL_BASE + 0x70 + 4*(i))
 
@@ -184,10 +192,33 @@ irq_init()
 
     put32(GICD_CTLR, GICD_CTLR_ENABLE);
 
-    /* Initialize core 0 CPU interface. */
+#endif
+}
+
+/* Initialize the interrupt controller for this cpu. */
+void
+irq_init_cpu()
+{
+#ifndef USE_GIC
+    put32(MBOX_INT_CTRL(cpuid()), MBOX_INT_MBOX0);
+#else
+    /* The CPU interface is banked per core, SGIs are always enabled. */
     put32(GICC_PMR, GICC_PMR_PRIORITY);
     put32(GICC_CTLR, GICC_CTLR_ENABLE);
+#endif
+}
 
+/*
+ * Send inter-processor interrupt ipi to cpu i, which is bit ipi of its
+ * mailbox 0 on legacy controller and SGI ipi on GIC.
+ */
+void
+ipi_send(int i, int ipi)
+{
+#ifndef USE_GIC
+    put32(MBOX_SET(i, 0), 1 << ipi);
+#else
+    put32(GICD_SGIR, ((1 << i) << GICD_SGIR_CPU_TARGET_LIST__SHIFT) | ipi);
 #endif
 }
 
@@ -240,7 +271,16 @@ irq_handler()
     int nack = 0;
 #ifndef USE_GIC
     int src = get32(IRQ_SRC_CORE(cpuid()));
-    assert(!(src & ~(IRQ_SRC_CNTPNSIRQ | IRQ_SRC_GPU | IRQ_SRC_TIMER)));
+    assert(!(src & ~(IRQ_SRC_CNTPNSIRQ | IRQ_SRC_GPU | IRQ_SRC_TIMER
+                     | IRQ_SRC_MBOX0)));
+    if (src & IRQ_SRC_MBOX0) {
+        uint32_t m = get32(MBOX_CLR(cpuid(), 0));
+        put32(MBOX_CLR(cpuid(), 0), m);
+        for (int ipi = 0; ipi < NIPI; ipi++)
+            if (m & (1 << ipi))
+                sched_ipi(ipi);
+        nack++;
+    }
     if (src & IRQ_SRC_CNTPNSIRQ) {
         timer_intr();
         nack++;
@@ -270,11 +310,9 @@ irq_handler()
             /* Peripheral interrupts (PPI and SPI). */
             nack += handle1(i);
         } else {
-            /* Software generated interrupts (SGI). */
-            uint32_t core =
-                (iar & GICC_IAR_CPUID__MASK) >> GICC_IAR_CPUID__SHIFT;
-
-            panic("unimplemented, irq %d, core %d", i, core);
+            /* Software generated interrupts (SGI), sent by ipi_send(). */
+            sched_ipi(i);
+            nack++;
         }
         put32(GICC_EOIR, iar);
     } else {
@@ -4,7 +4,9 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "dev.h"
 #include "string.h"
+#include "workqueue.h"
 
 /* Simple logging that allows concurrent FS system calls.
  *
@@ -20,6 +22,10 @@
  * But if it thinks the log is close to running out, it
  * sleeps until the last outstanding end_op() commits.
  *
+ * The commit is done by a worker of the workqueue rather than by the
+ * last end_op(), so that the system call can return without waiting
+ * for the disk. Following begin_op() waits until it is finished.
+ *
  * The log is a physical re-do log containing disk blocks.
  * The on-disk log format:
  *   header block, containing block #s for block A, B, C, ...
@@ -47,6 +53,7 @@ struct log {
     int committing;             // In commit(), please wait.
     int dev;
     struct logheader lh;
+    struct work work;           // Runs commit_work().
 };
 struct log log;
 
@@ -54,6 +61,7 @@ extern void readsb(int dev, struct superblock *sb);
 
 static void recover_from_log();
 static void commit();
+static void commit_work(struct work *);
 
 void
 initlog(int dev)
@@ -62,25 +70,49 @@ initlog(int dev)
         panic("initlog: too big logheader");
 
     struct superblock sb;
-    initlock(&log.lock);
+    initlock(&log.lock, "log");
     readsb(dev, &sb);
     log.start = sb.logstart;
     log.size = sb.nlog;
     log.dev = dev;
+    work_init(&log.work, commit_work);
     recover_from_log();
 }
 
-/* Copy committed blocks from log to their home location. */
+/*
+ * Copy committed blocks from log to their home location.
+ * Home blocks of a chunk are written together, so they are locked
+ * in ascending order as bread_range() does, and adjacent ones are
+ * merged by the disk.
+ */
 static void
 install_trans()
 {
-    for (int tail = 0; tail < log.lh.n; tail++) {
-        struct buf *lbuf = bread(log.dev, log.start + tail + 1);        // read log block
-        struct buf *dbuf = bread(log.dev, log.lh.block[tail]);  // read dst
-        memmove(dbuf->data, lbuf->data, BSIZE); // copy block to dst
-        bwrite(dbuf);           // write dst to disk
-        brelse(lbuf);
-        brelse(dbuf);
+    struct buf *lbuf[NBATCH], *dbuf[NBATCH];
+    int idx[NBATCH];
+    struct bio bio;
+    for (int tail = 0, n; tail < log.lh.n; tail += n) {
+        n = MIN(log.lh.n - tail, NBATCH);
+        bread_range(log.dev, log.start + tail + 1, n, lbuf);   // read log blocks
+
+        for (int i = 0; i < n; i++) {
+            int j = i, bno = log.lh.block[tail + i];
+            for (; j > 0 && log.lh.block[tail + idx[j - 1]] > bno; j--)
+                idx[j] = idx[j - 1];
+            idx[j] = i;
+        }
+        for (int i = 0; i < n; i++) {
+            dbuf[i] = bread(log.dev, log.lh.block[tail + idx[i]]);     // read dst
+            memmove(dbuf[i]->data, lbuf[idx[i]]->data, BSIZE); // copy block to dst
+            dbuf[i]->flags |= B_DIRTY;
+        }
+        bio_init(&bio, 0, 0);
+        submit_bio(&bio, dbuf, n);      // write dst to disk
+        for (int i = 0; i < n; i++)
+            brelse(lbuf[i]);
+        bio_wait(&bio);
+        for (int i = 0; i < n; i++)
+            brelse(dbuf[i]);
     }
 }
 
@@ -170,28 +202,40 @@ end_op()
     }
     release(&log.lock);
 
-    if (do_commit) {
-        // call commit w/o holding locks, since not allowed
-        // to sleep with locks.
-        commit();
-        acquire(&log.lock);
-        log.committing = 0;
-        wakeup(&log);
-        release(&log.lock);
-    }
+    if (do_commit)
+        work_queue(&log.work);
+}
+
+/*
+ * Commit the transaction closed by end_op(), w/o holding locks
+ * since not allowed to sleep with locks.
+ */
+static void
+commit_work(struct work *w)
+{
+    commit();
+    acquire(&log.lock);
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
 }
 
 /* Copy modified blocks from cache to log. */
 static void
 write_log()
 {
-    for (int tail = 0; tail < log.lh.n; tail++) {
-        struct buf *to = bread(log.dev, log.start + tail + 1);  // log block
-        struct buf *from = bread(log.dev, log.lh.block[tail]);  // cache block
-        memmove(to->data, from->data, BSIZE);
-        bwrite(to);             // write the log
-        brelse(from);
-        brelse(to);
+    struct buf *to[NBATCH];
+    for (int tail = 0, n; tail < log.lh.n; tail += n) {
+        n = MIN(log.lh.n - tail, NBATCH);
+        bread_range(log.dev, log.start + tail + 1, n, to);     // log blocks
+        for (int i = 0; i < n; i++) {
+            struct buf *from = bread(log.dev, log.lh.block[tail + i]);  // cache block
+            memmove(to[i]->data, from->data, BSIZE);
+            brelse(from);
+        }
+        bwritev(to, n);         // write the log
+        for (int i = 0; i < n; i++)
+            brelse(to[i]);
     }
 }
 
@@ -12,8 +12,10 @@
 #include "proc.h"
 #include "emmc.h"
 #include "buf.h"
+#include "file.h"
 #include "mbox.h"
 #include "irq.h"
+#include "workqueue.h"
 
 /*
  * Keep it in data segment by explicitly initializing by zero,
@@ -39,6 +41,8 @@ main()
         proc_init();
         user_init();
         binit();
+        fileinit();
+        workqueue_init();
 
         // Tests
         mbox_test();
@@ -47,6 +51,7 @@ main()
     }
     release(&mp.lock);
 
+    irq_init_cpu();
     timer_init();
     trap_init();
     info("cpu %d init finished", cpuid());
@@ -7,6 +7,7 @@
 #include "spinlock.h"
 #include "console.h"
 #include "mbox.h"
+#include "proc.h"
 
 #ifdef DEBUG
 
@@ -17,45 +18,175 @@ static void *alloc_ptr[MAX_PAGES];
 
 extern char end[];
 
-struct freelist {
-    void *next;
-    void *start, *end;
-} freelist;
+/*
+ * Buddy allocator.
+ *
+ * Free memory is kept as blocks of 2^order pages, where a block of
+ * order k is always aligned to 2^k pages in physical memory. Each
+ * order has its own free list, linked through the page descriptors
+ * of the first page in each block. When a block is freed, it is merged
+ * with its buddy (the other half of the parent block) as long as the
+ * buddy is free as well.
+ */
+struct free_area {
+    struct list_head head;
+    size_t cnt;                 /* Number of free blocks of this order. */
+};
+
+static struct {
+    struct free_area area[MAX_ORDER];
+    size_t nfree;               /* Number of free pages. */
+    uint64_t base, npages;      /* Page frame numbers covered by pages[]. */
+} buddy;
+
+/* Page descriptors of all managed memory, indexed by pfn - buddy.base. */
+static struct page *pages;
 
 static struct spinlock memlock;
 
+/*
+ * Per-CPU page cache in front of the buddy allocator.
+ *
+ * Since the kernel is never interrupted nor preempted, each cpu can
+ * access its own cache without any lock. Pages are moved between the
+ * cache and the buddy allocator PCP_BATCH at a time, so that memlock
+ * is taken at most once every PCP_BATCH kalloc()/kfree() on a cpu.
+ */
+#define PCP_BATCH   32
+#define PCP_HIGH    (2 * PCP_BATCH)
+
+struct pcpu_cache {
+    int cnt;
+    void *page[PCP_HIGH];
+
+    /* Statistics, reported by mm_dump(). */
+    uint64_t nalloc, nfree;     /* Number of kalloc()/kfree() */
+    uint64_t hit;               /* kalloc() served without memlock */
+    uint64_t refill, drain;     /* Batches moved from/to the buddy allocator */
+} __attribute__((aligned(64)));
+
+static struct pcpu_cache pcp[NCPU];
+
 void mm_test();
 
+/* Return the descriptor of the page containing kernel address va. */
+struct page *
+va2page(void *va)
+{
+    uint64_t pfn = V2P(va) / PGSIZE;
+    assert(buddy.base <= pfn && pfn < buddy.base + buddy.npages);
+    return &pages[pfn - buddy.base];
+}
+
+/* Return the kernel address of the page described by pg. */
+void *
+page2va(struct page *pg)
+{
+    return P2V((buddy.base + (pg - pages)) * PGSIZE);
+}
+
 /*
- * Allocate one 4096-byte page of physical memory.
- * Returns a pointer that the kernel can use.
- * Returns 0 if the memory cannot be allocated.
+ * Allocate a block of 2^order pages from the buddy allocator.
+ * Caller must hold memlock.
  */
 static void *
-freelist_alloc(struct freelist *f)
+buddy_alloc(int order)
 {
-    void *p = f->next;
-    if (p)
-        f->next = *(void **)p;
-    return p;
+    int k;
+    for (k = order; k < MAX_ORDER && !buddy.area[k].cnt; k++) ;
+    if (k == MAX_ORDER)
+        return 0;
+
+    struct page *pg =
+        container_of(list_front(&buddy.area[k].head), struct page, link);
+    list_drop(&pg->link);
+    buddy.area[k].cnt--;
+    pg->flags &= ~PG_BUDDY;
+
+    /* Split the block and give back the upper halves. */
+    while (k > order) {
+        k--;
+        struct page *half = pg + (1 << k);
+        half->flags |= PG_BUDDY;
+        half->order = k;
+        list_push_front(&buddy.area[k].head, &half->link);
+        buddy.area[k].cnt++;
+    }
+    buddy.nfree -= 1 << order;
+    return page2va(pg);
 }
 
 /*
- * Free the page of physical memory pointed at by v.
+ * Free a block of 2^order pages to the buddy allocator, coalescing
+ * it with its buddies. Caller must hold memlock.
  */
 static void
-freelist_free(struct freelist *f, void *v)
+buddy_free(void *va, int order)
 {
-    *(void **)v = f->next;
-    f->next = v;
+    uint64_t pfn = V2P(va) / PGSIZE;
+    assert(pfn % (1 << order) == 0);
+    buddy.nfree += 1 << order;
+
+    for (; order < MAX_ORDER - 1; order++) {
+        uint64_t bpfn = pfn ^ (1 << order);
+        if (bpfn < buddy.base
+            || bpfn + (1 << order) > buddy.base + buddy.npages)
+            break;
+        struct page *b = &pages[bpfn - buddy.base];
+        if (!(b->flags & PG_BUDDY) || b->order != order)
+            break;
+        list_drop(&b->link);
+        buddy.area[order].cnt--;
+        b->flags &= ~PG_BUDDY;
+        pfn &= ~(uint64_t) (1 << order);
+    }
+
+    struct page *pg = &pages[pfn - buddy.base];
+    assert(!(pg->flags & PG_BUDDY));
+    pg->flags |= PG_BUDDY;
+    pg->order = order;
+    list_push_front(&buddy.area[order].head, &pg->link);
+    buddy.area[order].cnt++;
+}
+
+/* Move up to PCP_BATCH pages from the buddy allocator into the cache. */
+static void
+pcp_refill(struct pcpu_cache *c)
+{
+    acquire(&memlock);
+    for (int i = 0; i < PCP_BATCH; i++) {
+        void *p = buddy_alloc(0);
+        if (!p)
+            break;
+        c->page[c->cnt++] = p;
+    }
+    release(&memlock);
+    c->refill++;
+}
+
+/* Return the oldest PCP_BATCH pages in the cache to the buddy allocator. */
+static void
+pcp_drain(struct pcpu_cache *c)
+{
+    acquire(&memlock);
+    for (int i = 0; i < PCP_BATCH; i++)
+        buddy_free(c->page[i], 0);
+    release(&memlock);
+    c->cnt -= PCP_BATCH;
+    memmove(c->page, c->page + PCP_BATCH, c->cnt * sizeof(c->page[0]));
+    c->drain++;
 }
 
 void
 free_range(void *start, void *end)
 {
     int cnt = 0;
-    for (void *p = start; p + PGSIZE <= end; p += PGSIZE, cnt++)
-        freelist_free(&freelist, p);
+    for (void *p = start; p + PGSIZE <= end; p += PGSIZE, cnt++) {
+#ifdef DEBUG
+        memset(p, 0xAC, PGSIZE);
+#endif
+        buddy_free(p, 0);
+    }
     info("0x%p ~ 0x%p, %d pages", start, end, cnt);
 }
 
@@ -64,18 +195,24 @@ mm_init()
 {
     // HACK Raspberry pi 4b.
     size_t phystop = MIN(0x3F000000, mbox_get_arm_memory());
-    free_range(ROUNDUP((void *)end, PGSIZE), P2V(phystop));
-#ifdef DEBUG
-    for (int i = 0; i < MAX_PAGES; i++) {
-        void *p = freelist_alloc(&freelist);
-        memset(p, 0xAC, PGSIZE);
-        alloc_ptr[i] = p;
-    }
-    for (int i = 0; i < MAX_PAGES; i++) {
-        freelist_free(&freelist, alloc_ptr[i]);
-        alloc_ptr[i] = 0;
-    }
-#endif
+    void *start = ROUNDUP((void *)end, PGSIZE);
+
+    initlock(&memlock, "buddy");
+    for (int i = 0; i < MAX_ORDER; i++)
+        list_init(&buddy.area[i].head);
+
+    /* Page descriptors are placed at the beginning of managed memory. */
+    buddy.base = V2P(start) / PGSIZE;
+    buddy.npages = phystop / PGSIZE - buddy.base;
+    pages = start;
+    memset(pages, 0, buddy.npages * sizeof(struct page));
+    start = ROUNDUP((void *)(pages + buddy.npages), PGSIZE);
+
+    acquire(&memlock);
+    free_range(start, P2V(phystop));
+    release(&memlock);
+
+    slab_init();
 }
 
 /*
@@ -86,9 +223,17 @@ mm_init()
 void *
 kalloc()
 {
-    acquire(&memlock);
-    void *p = freelist_alloc(&freelist);
+    struct pcpu_cache *c = &pcp[cpuid()];
+    c->nalloc++;
+    if (c->cnt)
+        c->hit++;
+    else
+        pcp_refill(c);
+    void *p = c->cnt ? c->page[--c->cnt] : 0;
+    if (p)
+        va2page(p)->ref = 1;
 #ifdef DEBUG
+    acquire(&memlock);
     if (p) {
         for (int i = 8; i < PGSIZE; i++) {
             assert(*(char *)(p + i) == 0xAC);
@@ -106,17 +251,30 @@ kalloc()
         }
     } else
         warn("null");
-#endif
     release(&memlock);
+#endif
     return p;
 }
 
-/* Free the physical memory pointed at by v. */
+/*
+ * Free the memory pointed at by v, which is either a page returned by
+ * kalloc() or an object returned by kmalloc()/kmem_cache_alloc().
+ */
 void
 kfree(void *va)
 {
-    acquire(&memlock);
+    struct page *pg = va2page(va);
+    if (pg->flags & PG_SLAB) {
+        kmem_cache_free(pg->cache, va);
+        return;
+    }
+    if (pg->flags & PG_LARGE) {
+        pg->flags &= ~PG_LARGE;
+        kfree_pages(va, pg->order);
+        return;
+    }
 #ifdef DEBUG
+    acquire(&memlock);
     memset(va, 0xAC, PGSIZE);   // For debug.
     int i;
     for (i = 0; i < MAX_PAGES; i++) {
@@ -128,15 +286,95 @@ kfree(void *va)
     if (i == MAX_PAGES) {
         panic("kfree: not allocated. ");
     }
+    release(&memlock);
 #endif
-    freelist_free(&freelist, va);
+    struct pcpu_cache *c = &pcp[cpuid()];
+    c->nfree++;
+    if (c->cnt == PCP_HIGH)
+        pcp_drain(c);
+    c->page[c->cnt++] = va;
+}
+
+/* Take another reference to the page at va returned by kalloc(). */
+void
+page_get(void *va)
+{
+    __atomic_add_fetch(&va2page(va)->ref, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference to the page at va and free it if it was the last. */
+void
+page_put(void *va)
+{
+    if (__atomic_sub_fetch(&va2page(va)->ref, 1, __ATOMIC_ACQ_REL) == 0)
+        kfree(va);
+}
+
+/*
+ * Allocate 2^order physically contiguous pages, aligned to
+ * 2^order pages. Returns 0 if failed else a pointer.
+ */
+void *
+kalloc_pages(int order)
+{
+    if (order == 0)
+        return kalloc();
+    if (order < 0 || order >= MAX_ORDER)
+        return 0;
+
+    acquire(&memlock);
+    void *p = buddy_alloc(order);
     release(&memlock);
+#ifdef DEBUG
+    if (p) {
+        for (int i = 0; i < (PGSIZE << order); i++)
+            assert(*(char *)(p + i) == 0xAC);
+    }
+#endif
+    return p;
 }
 
+/* Free 2^order pages returned by kalloc_pages(order). */
+void
+kfree_pages(void *va, int order)
+{
+    if (order == 0) {
+        kfree(va);
+        return;
+    }
+    assert(0 < order && order < MAX_ORDER);
+#ifdef DEBUG
+    memset(va, 0xAC, PGSIZE << order);
+#endif
+    acquire(&memlock);
+    buddy_free(va, order);
+    release(&memlock);
+}
 
 void
 mm_dump()
 {
+    /*
+     * For each order k, the unusable index is the fraction of free
+     * memory which cannot satisfy an allocation of order k. It grows
+     * from 0 to 100 as free memory gets fragmented.
+     */
+    size_t nfree = buddy.nfree, usable = nfree;
+    cprintf("free pages: %lld in buddy\n", nfree);
+    for (int k = 0; k < MAX_ORDER; k++) {
+        size_t cnt = buddy.area[k].cnt;
+        cprintf("order %d: %lld free blocks, unusable %lld%%\n", k, cnt,
+                nfree ? (nfree - usable) * 100 / nfree : 0);
+        usable -= MIN(usable, cnt << k);
+    }
+
+    for (int i = 0; i < NCPU; i++) {
+        struct pcpu_cache *c = &pcp[i];
+        cprintf("cpu %d: %d cached, alloc %lld (hit %lld), free %lld, "
+                "refill %lld, drain %lld\n", i, c->cnt, c->nalloc, c->hit,
+                c->nfree, c->refill, c->drain);
+    }
+    slab_dump();
 #ifdef DEBUG
     int cnt = 0;
     for (int i = 0; i < MAX_PAGES; i++) {
@@ -160,5 +398,29 @@ mm_test()
     }
     while (i--)
         kfree(p[i]);
+
+    /* Blocks are aligned and coalesced back on free. */
+    size_t nfree = buddy.nfree;
+    for (i = 1; i < MAX_ORDER; i++) {
+        p[i] = kalloc_pages(i);
+        assert(p[i] && V2P(p[i]) % (PGSIZE << i) == 0);
+        memset(p[i], 0xFF, PGSIZE << i);
+    }
+    while (--i)
+        kfree_pages(p[i], i);
+    assert(buddy.nfree == nfree);
+
+    /* Objects of kmalloc() do not overlap and are freed by kfree(). */
+    for (i = 0; i < 1000; i++) {
+        size_t sz = 1 << (i % 14);
+        p[i] = kmalloc(sz);
+        assert(p[i]);
+        memset(p[i], i, sz);
+    }
+    for (i = 0; i < 1000; i++) {
+        assert(*(char *)p[i] == (char)i);
+        kfree(p[i]);
+    }
+    info("pass");
 #endif
 }
@@ -27,13 +27,13 @@ pipealloc(struct file **f0, struct file **f1)
     *f0 = *f1 = 0;
     if ((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
         goto bad;
-    if ((p = (struct pipe *)kalloc()) == 0)
+    if ((p = kmalloc(sizeof(*p))) == 0)
         goto bad;
     p->readopen = 1;
     p->writeopen = 1;
     p->nwrite = 0;
     p->nread = 0;
-    initlock(&p->lock);
+    initlock(&p->lock, "pipe");
     (*f0)->type = FD_PIPE;
     (*f0)->readable = 1;
     (*f0)->writable = 0;
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE             /* For CLONE_* in <sched.h>. */
+
 #include "proc.h"
 
 #include "string.h"
@@ -8,6 +10,11 @@
 #include "mm.h"
 #include "vm.h"
 #include "spinlock.h"
+#include "irq.h"
+#include "timer.h"
+#include "trap.h"
+
+#include <sched.h>
 
 #include "dev.h"
 #include "debug.h"
@@ -18,60 +25,329 @@ extern void trapret();
 extern void swtch(struct context **old, struct context *new);
 
 static void forkret();
-static void idle_init();
 
 #define SQSIZE  0x100           /* Must be power of 2. */
+#define BOOST_MS        1000    /* Period to raise demoted processes. */
 #define HASH(x) ((((uint64_t)(x)) >> 5) & (SQSIZE - 1))
+#define PIDHASH 64              /* Must be power of 2. */
 
 struct cpu cpu[NCPU];
 
-struct {
-    struct proc proc[NPROC];
-    struct list_head slpque[SQSIZE];
-    struct list_head sched_que;
+/* A bucket of sleeping processes, hashed by channel. */
+struct sleepq {
     struct spinlock lock;
+    struct list_head que;
+} __attribute__((aligned(64)));
+
+/*
+ * Locks are acquired in the order of p->lock, ptable.treelock, the
+ * lock of a sleep queue and the lock of a run queue. There are two
+ * exceptions, which take p->lock in sleep() while holding the lock
+ * passed to it: wait(), which sleeps on treelock, and futex_wait(),
+ * which sleeps on the lock of the sleep queue itself. Both are safe
+ * since no one else acquires the lock of a running process. The lock
+ * of an address space is taken before the lock of a sleep queue by
+ * futexes, and so is ptable.lock by kill().
+ */
+struct {
+    struct kmem_cache cache;
+    struct list_head procs;     /* All allocated processes. */
+    struct list_head pidhash[PIDHASH];  /* Processes hashed by pid. */
+    struct spinlock lock;       /* Protects procs, pidhash and pid. */
+    struct spinlock treelock;   /* Protects parent, child and clink. */
+    struct sleepq slpque[SQSIZE];
 } ptable;
 
 struct proc *initproc;
 static int pid = 0;
 
+/* Empty page table loaded by idle cpus. */
+static uint64_t *idle_pgdir;
+
 void
 proc_init()
 {
-    list_init(&ptable.sched_que);
-    for (int i = 0; i < SQSIZE; i++)
-        list_init(&ptable.slpque[i]);
+    kmem_cache_init(&ptable.cache, "proc", sizeof(struct proc));
+    initlock(&ptable.lock, "ptable");
+    initlock(&ptable.treelock, "proctree");
+    list_init(&ptable.procs);
+    for (int i = 0; i < PIDHASH; i++)
+        list_init(&ptable.pidhash[i]);
+    for (int i = 0; i < SQSIZE; i++) {
+        initlock(&ptable.slpque[i].lock, "sleepq");
+        list_init(&ptable.slpque[i].que);
+    }
+    for (struct cpu * c = cpu; c < cpu + NCPU; c++) {
+        initlock(&c->lock, "runq");
+        for (int i = 0; i < NPRIO; i++)
+            list_init(&c->runq[i]);
+    }
+    idle_pgdir = vm_init();
+    assert(idle_pgdir);
 }
 
-// TODO: use kmalloc
 /*
- * Look in the process table for an UNUSED proc.
- * If found, change state to EMBRYO and initialize
- * state required to run in the kernel.
- * Otherwise return 0.
+ * Per-CPU run queues.
+ *
+ * Each cpu schedules processes from its own run queue, which is
+ * protected by its own lock. A cpu with an empty run queue steals
+ * from the busiest one, or else waits for interrupts in cpu_idle()
+ * until some process is queued and it is kicked by runq_push().
+ *
+ * Run queues are multi-level feedback queues. A process is queued to the
+ * level of its priority and the highest level is served first, where a
+ * time slice is twice as long as that of the level above. A process
+ * moves down a level each time it uses up its time slice, and is raised
+ * back to its base level, which is decided by its policy and nice, after
+ * staying BOOST_MS below it, so that interactive processes stay ahead of
+ * CPU-bound ones without starving them.
+ *
+ * A process only runs on the cpus in its affinity mask. It is queued to
+ * an allowed cpu and only stolen by the allowed ones.
+ *
+ * Since a process might be stolen right after it is queued, the
+ * process lock is held across swtch(): scheduler() acquires it before
+ * switching to a process, and a process holds it when switching back.
+ */
+
+/* The highest level process p can be queued to. */
+static int
+prio_base(struct proc *p)
+{
+    switch (p->policy) {
+    case SCHED_IDLE:
+        return NPRIO - 1;
+    case SCHED_BATCH:
+        return NMLFQ - 1;
+    default:
+        return MIN(MAX(p->nice, 0) * NMLFQ / 20, NMLFQ - 1);
+    }
+}
+
+/* Whether process p is allowed to run on cpu c. */
+static inline int
+cpu_allowed(struct proc *p, struct cpu *c)
+{
+    return (p->affinity >> (c - cpu)) & 1;
+}
+
+/*
+ * Append runnable process p to the run queue of c, or of the first cpu
+ * p is allowed to run on if not c.
+ */
+static void
+runq_push(struct cpu *c, struct proc *p)
+{
+    if (!cpu_allowed(p, c))
+        c = &cpu[__builtin_ctzl(p->affinity)];
+
+    int base = prio_base(p);
+    p->readytime = timestamp();
+    if (p->level < base || (p->level > base && p->readytime - p->demotetime
+                            >= timerfreq() / 1000 * BOOST_MS)) {
+        p->level = base;
+        p->slice = 0;
+    }
+
+    acquire(&c->lock);
+    list_push_back(&c->runq[p->level], &p->link);
+    c->nrunnable++;
+    release(&c->lock);
+
+    /*
+     * Kick c if it is idle, or else any idle cpu to steal p. If all
+     * cpus are busy, preempt c if p has a higher priority than the
+     * process running there, so that p need not wait for a tick.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    struct cpu *t = c;
+    if (!t->idle)
+        for (t = cpu; t < cpu + NCPU && !(t->idle && cpu_allowed(p, t));
+             t++) ;
+    if (t < cpu + NCPU) {
+        if (t != thiscpu())
+            ipi_send(t - cpu, IPI_WAKEUP);
+    } else if (p->level < c->level) {
+        if (c != thiscpu())
+            ipi_send(c - cpu, IPI_RESCHED);
+        else if (c->proc)
+            c->resched = 1;
+    }
+}
+
+/*
+ * Pop the first process allowed to run on cpu t of the highest level in
+ * the run queue of c, or return 0 if none.
  */
 static struct proc *
-proc_alloc()
+runq_pop(struct cpu *c, struct cpu *t)
 {
     struct proc *p;
-    int found = 0;
+    if (!c->nrunnable)
+        return 0;
+    acquire(&c->lock);
+    for (int i = 0; i < NPRIO; i++) {
+        LIST_FOREACH_ENTRY(p, &c->runq[i], link) {
+            if (cpu_allowed(p, t)) {
+                list_drop(&p->link);
+                c->nrunnable--;
+                release(&c->lock);
+                return p;
+            }
+        }
+    }
+    release(&c->lock);
+    return 0;
+}
 
-    acquire(&ptable.lock);
-    for (p = ptable.proc; p < ptable.proc + NPROC; p++) {
-        if (p->state == UNUSED) {
-            memset(p, 0, sizeof(*p));
-            found = 1;
-            break;
+/*
+ * Requeue p if it is queued on a cpu it is no longer allowed to run on,
+ * which would never pop it.
+ */
+static void
+runq_migrate(struct proc *p)
+{
+    struct proc *q;
+    for (struct cpu * c = cpu; c < cpu + NCPU; c++) {
+        if (cpu_allowed(p, c) || !c->nrunnable)
+            continue;
+        acquire(&c->lock);
+        for (int i = 0; i < NPRIO; i++) {
+            LIST_FOREACH_ENTRY(q, &c->runq[i], link) {
+                if (q == p) {
+                    list_drop(&p->link);
+                    c->nrunnable--;
+                    release(&c->lock);
+                    runq_push(c, p);
+                    return;
+                }
+            }
         }
+        release(&c->lock);
     }
+}
 
-    if (!found || !(p->kstack = kalloc())) {
-        release(&ptable.lock);
+/* Steal a process for c, trying cpus with longer run queues first. */
+static struct proc *
+runq_steal(struct cpu *c)
+{
+    struct proc *p = 0;
+    int tried = 1 << (c - cpu);
+    while (!p) {
+        struct cpu *victim = 0;
+        for (struct cpu * v = cpu; v < cpu + NCPU; v++) {
+            if (!(tried >> (v - cpu) & 1) && v->nrunnable
+                && (!victim || v->nrunnable > victim->nrunnable))
+                victim = v;
+        }
+        if (!victim)
+            return 0;
+        tried |= 1 << (victim - cpu);
+        p = runq_pop(victim, c);
+    }
+    c->nsteal++;
+    return p;
+}
+
+/*
+ * Wait for interrupts with the timer of c stopped, until there is a
+ * process for c to run, which is returned. Interrupts are still masked
+ * after wfi wakes up, thus they are handled here rather than trapped.
+ */
+static struct proc *
+cpu_idle(struct cpu *c)
+{
+    struct proc *p;
+    uint64_t t = timestamp();
+    c->proc = 0;
+    uvm_switch(idle_pgdir);
+    timer_disable();
+
+    /* Pairs with the fence in runq_push() so that no kick is missed. */
+    c->idle = 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!(p = runq_pop(c, c)) && !(p = runq_steal(c))) {
+        wfi();
+        irq_handler();
+    }
+    c->idle = 0;
+    c->idletime += timestamp() - t;
+    return p;
+}
+
+/* Account scheduling latency of t ticks to h. */
+static void
+lat_add(struct lathist *h, uint64_t t)
+{
+    uint64_t us = t / (timerfreq() / 1000000);
+    int i = 0;
+    while (i < NLATBUCKET - 1 && us >> (i + 1))
+        i++;
+    h->n++;
+    h->total += t;
+    h->max = MAX(h->max, t);
+    h->bucket[i]++;
+}
+
+/* Print the sum of histogram at offset off of struct cpu of all cpus. */
+static void
+lat_dump(char *name, size_t off)
+{
+    struct lathist h = { 0 };
+    for (struct cpu * c = cpu; c < cpu + NCPU; c++) {
+        struct lathist *x = (void *)c + off;
+        h.n += x->n;
+        h.total += x->total;
+        h.max = MAX(h.max, x->max);
+        for (int i = 0; i < NLATBUCKET; i++)
+            h.bucket[i] += x->bucket[i];
+    }
+
+    uint64_t us = timerfreq() / 1000000;
+    cprintf("%s latency: %lld, avg %lld us, max %lld us\n", name, h.n,
+            h.total / (h.n ? h.n : 1) / us, h.max / us);
+    for (int i = 0; i < NLATBUCKET; i++)
+        if (h.bucket[i])
+            cprintf("  [%lld, %lld) us: %lld\n", i ? 1L << i : 0L,
+                    1L << (i + 1), h.bucket[i]);
+}
+
+/*
+ * Handle an inter-processor interrupt sent by runq_push(). An idle cpu
+ * has nothing to do since it is already awake.
+ */
+void
+sched_ipi(int ipi)
+{
+    struct cpu *c = thiscpu();
+    c->nipi++;
+    if (ipi == IPI_RESCHED && c->proc)
+        c->resched = 1;
+}
+
+/*
+ * Allocate a proc, change its state to EMBRYO and initialize
+ * state required to run in the kernel.
+ * Return 0 if out of memory.
+ */
+static struct proc *
+proc_alloc()
+{
+    struct proc *p = kmem_cache_alloc(&ptable.cache);
+    if (!p)
+        return 0;
+    memset(p, 0, sizeof(*p));
+    if (!(p->kstack = kalloc())) {
+        kmem_cache_free(&ptable.cache, p);
         return 0;
     }
 
+    acquire(&ptable.lock);
     p->pid = ++pid;
     p->state = EMBRYO;
+    p->affinity = (1 << NCPU) - 1;
+    list_push_back(&ptable.procs, &p->plink);
+    list_push_back(&ptable.pidhash[p->pid & (PIDHASH - 1)], &p->hlink);
     release(&ptable.lock);
 
     p->name[0] = 0;
@@ -94,6 +370,19 @@ proc_alloc()
     return p;
 }
 
+/*
+ * Free a proc allocated by proc_alloc() except its page table.
+ * The ptable lock must be held.
+ */
+static void
+proc_free(struct proc *p)
+{
+    list_drop(&p->plink);
+    list_drop(&p->hlink);
+    kfree(p->kstack);
+    kmem_cache_free(&ptable.cache, p);
+}
+
 static struct proc *
 proc_initx(char *name, char *code, size_t len)
 {
@@ -101,10 +390,10 @@ proc_initx(char *name, char *code, size_t len)
     void *va = kalloc();
     assert(p && va);
 
-    p->pgdir = vm_init();
-    assert(p->pgdir);
+    p->vm = vmspace_alloc();
+    assert(p->vm);
 
-    int ret = uvm_map(p->pgdir, 0, PGSIZE, V2P(va));
+    int ret = uvm_map(p->vm->pgdir, 0, PGSIZE, V2P(va));
     assert(ret == 0);
 
     memmove(va, code, len);
@@ -113,9 +402,9 @@ proc_initx(char *name, char *code, size_t len)
     // Flush dcache to memory so that icache can retrieve the correct one.
     dccivac(va, len);
 
-    p->stksz = 0;
-    p->sz = PGSIZE;
-    p->base = 0;
+    p->vm->stksz = 0;
+    p->vm->sz = PGSIZE;
+    p->vm->base = 0;
 
     p->tf->elr = 0;
 
@@ -123,12 +412,36 @@ proc_initx(char *name, char *code, size_t len)
     return p;
 }
 
-/* Initialize per-cpu idle process. */
+/* Entry of kernel threads, see kthread_create(). */
 static void
-idle_init()
+kthread_start()
+{
+    struct proc *p = thisproc();
+    release(&p->lock);
+    p->kfn(p->karg);
+    panic("kthread '%s' returns", p->name);
+}
+
+/*
+ * Create a kernel thread running fn(arg) on cpus in mask, which has no
+ * user space and never returns. Return 0 if out of memory.
+ */
+struct proc *
+kthread_create(void (*fn)(void *), void *arg, char *name, uint64_t mask)
 {
-    extern char ispin[], eicode[];
-    thiscpu()->idle = proc_initx("idle", ispin, (size_t)(eicode - ispin));
+    struct proc *p = proc_alloc();
+    if (!p)
+        return 0;
+    p->context->lr0 = (uint64_t) kthread_start;
+    p->context->lr = 0;
+    p->kfn = fn;
+    p->karg = arg;
+    p->affinity = mask;
+    safestrcpy(p->name, name, sizeof(p->name));
+
+    p->state = RUNNABLE;
+    runq_push(&cpu[__builtin_ctzl(mask)], p);
+    return p;
 }
 
 /* Set up the first user process. */
@@ -137,12 +450,12 @@ user_init()
 {
     extern char icode[], eicode[];
     struct proc *p = proc_initx("icode", icode, (size_t)(eicode - icode));
+    initproc = p;
     p->cwd = namei("/");
     assert(p->cwd);
 
-    acquire(&ptable.lock);
-    list_push_back(&ptable.sched_que, &p->link);
-    release(&ptable.lock);
+    p->state = RUNNABLE;
+    runq_push(thiscpu(), p);
 }
 
 /*
@@ -157,20 +470,40 @@ user_init()
 void
 scheduler()
 {
-    idle_init();
+    struct cpu *c = thiscpu();
     for (struct proc * p;;) {
-        acquire(&ptable.lock);
-        struct list_head *head = &ptable.sched_que;
-        if (list_empty(head)) {
-            p = thiscpu()->idle;
-        } else {
-            p = container_of(list_front(head), struct proc, link);
-            list_pop_front(head);
-        }
-        uvm_switch(p->pgdir);
-        thiscpu()->proc = p;
-        swtch(&thiscpu()->scheduler, p->context);
-        release(&ptable.lock);
+        if (!(p = runq_pop(c, c)) && !(p = runq_steal(c)))
+            p = cpu_idle(c);
+
+        /* Wait until p has switched out if it is just queued. */
+        acquire(&p->lock);
+        uint64_t now = timestamp();
+        lat_add(p->woken ? &c->wakelat : &c->runlat, now - p->readytime);
+        p->woken = 0;
+        p->state = RUNNING;
+        if (p->cpu != c - cpu)
+            p->nmigrate++;
+        p->cpu = c - cpu;
+        c->resched = 0;
+        /* A preempted process resumes its slice rather than renews it. */
+        p->deadline = now + (p->slice ? p->slice
+                             : timer_quantum() << MIN(p->level, NMLFQ - 1));
+        p->slice = 0;
+        p->tstamp = now;
+        timer_set(p->deadline);
+        uvm_switch(p->vm ? p->vm->pgdir : idle_pgdir);
+        c->proc = p;
+        c->level = p->level;
+        c->nswtch++;
+        swtch(&c->scheduler, p->context);
+
+        /* Switched out in kernel, see trap() for user time. */
+        p->ru.stime += timestamp() - p->tstamp;
+        if (p->state == RUNNABLE)
+            p->ru.nivcsw++;
+        else
+            p->ru.nvcsw++;
+        release(&p->lock);
     }
 }
 
@@ -183,15 +516,15 @@ static void
 forkret()
 {
     static int first = 1;
-    if (first && thisproc() != thiscpu()->idle) {
+    if (first) {
         first = 0;
-        release(&ptable.lock);
+        release(&thisproc()->lock);
 
         dev_init();
         iinit(ROOTDEV);
         initlog(ROOTDEV);
     } else {
-        release(&ptable.lock);
+        release(&thisproc()->lock);
     }
     trace("proc '%s'(%d)", thisproc()->name, thisproc()->pid);
 }
@@ -201,13 +534,18 @@ void
 yield()
 {
     struct proc *p = thisproc();
-    acquire(&ptable.lock);
-    if (p != thiscpu()->idle)
-        list_push_back(&ptable.sched_que, &p->link);
+    acquire(&p->lock);
     p->state = RUNNABLE;
+    uint64_t now = timestamp();
+    if (now < p->deadline) {
+        p->slice = p->deadline - now;
+    } else if (p->level < NMLFQ - 1) {
+        p->level++;
+        p->demotetime = now;
+    }
+    runq_push(thiscpu(), p);
     swtch(&p->context, thiscpu()->scheduler);
-    p->state = RUNNING;
-    release(&ptable.lock);
+    release(&p->lock);
 }
 
 /*
@@ -218,46 +556,59 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
     struct proc *p = thisproc();
-    int i = HASH(chan);
-    assert(i < SQSIZE);
-    assert(p != thiscpu()->idle);
-
-    if (lk != &ptable.lock) {
-        acquire(&ptable.lock);
+    struct sleepq *q = &ptable.slpque[HASH(chan)];
+
+    /*
+     * Once p is in the sleep queue, it can be woken up and queued to
+     * run before switching out, which is guarded by p->lock.
+     */
+    acquire(&p->lock);
+    if (lk != &q->lock) {
+        acquire(&q->lock);
         release(lk);
     }
 
     p->chan = chan;
-    list_push_back(&ptable.slpque[i], &p->link);
+    list_push_back(&q->que, &p->link);
 
     p->state = SLEEPING;
+    release(&q->lock);
+
     trace("'%s'(%d) sleep lk=0x%p", p->name, p->pid, lk);
-    swtch(&thisproc()->context, thiscpu()->scheduler);
+    swtch(&p->context, thiscpu()->scheduler);
     trace("'%s'(%d) wakeup lk=0x%p", p->name, p->pid, lk);
-    p->state = RUNNING;
 
-    if (lk != &ptable.lock) {
-        release(&ptable.lock);
-        acquire(lk);
-    }
+    release(&p->lock);
+    acquire(lk);
+}
+
+/*
+ * Make sleeping process p runnable.
+ * The lock of the sleep queue of p must be held.
+ */
+static void
+wakeup_proc(struct proc *p)
+{
+    list_drop(&p->link);
+    p->state = RUNNABLE;
+    p->woken = 1;
+    runq_push(&cpu[p->cpu], p);
 }
 
 /*
  * Wake up all processes sleeping on chan.
- * The ptable lock must be held.
+ * The lock of the sleep queue of chan must be held.
  */
 static void
 wakeup1(void *chan)
 {
-    struct list_head *q = &ptable.slpque[HASH(chan)];
+    struct list_head *q = &ptable.slpque[HASH(chan)].que;
     struct proc *p, *np;
 
     LIST_FOREACH_ENTRY_SAFE(p, np, q, link) {
         if (p->chan == chan) {
             trace("wake '%s'(%d)", p->name, p->pid);
-            list_drop(&p->link);
-            list_push_back(&ptable.sched_que, &p->link);
-            p->state = RUNNABLE;
+            wakeup_proc(p);
         }
     }
 }
@@ -266,9 +617,107 @@ wakeup1(void *chan)
 void
 wakeup(void *chan)
 {
-    acquire(&ptable.lock);
+    struct sleepq *q = &ptable.slpque[HASH(chan)];
+    acquire(&q->lock);
     wakeup1(chan);
+    release(&q->lock);
+}
+
+/*
+ * Futexes sleep on the user address itself, which never collides with
+ * kernel channels above KERNBASE. Processes of different address
+ * spaces are told apart by p->vm.
+ */
+
+/*
+ * Sleep on user address uaddr if it still contains val, which is
+ * checked atomically with respect to futex_wake().
+ * Return 0 if woken up, -1 if the value differs or uaddr is invalid.
+ */
+int
+futex_wait(int *uaddr, int val)
+{
+    struct proc *p = thisproc();
+    struct vmspace *vm = p->vm;
+    struct sleepq *q = &ptable.slpque[HASH(uaddr)];
+    if ((uint64_t) uaddr % sizeof(*uaddr) || !in_user(uaddr, sizeof(*uaddr))
+        || uvm_prefault(vm, uaddr, sizeof(*uaddr)) < 0)
+        return -1;
+
+    acquire(&vm->lock);
+    int *k = uvm_lookup(vm->pgdir, uaddr);
+    acquire(&q->lock);
+    int cur = k ? __atomic_load_n(k, __ATOMIC_RELAXED) : ~val;
+    release(&vm->lock);
+
+    /* Killed by kill_threads() is also checked under q->lock. */
+    if (cur != val || p->killed) {
+        release(&q->lock);
+        return -1;
+    }
+    sleep(uaddr, &q->lock);
+    release(&q->lock);
+    return 0;
+}
+
+/*
+ * Wake up at most n processes of the current address space sleeping on
+ * user address uaddr. Return the number of processes woken up.
+ */
+int
+futex_wake(int *uaddr, int n)
+{
+    struct vmspace *vm = thisproc()->vm;
+    struct sleepq *q = &ptable.slpque[HASH(uaddr)];
+    struct proc *p, *np;
+    int cnt = 0;
+
+    acquire(&q->lock);
+    LIST_FOREACH_ENTRY_SAFE(p, np, &q->que, link) {
+        if (cnt >= n)
+            break;
+        if (p->chan == uaddr && p->vm == vm) {
+            wakeup_proc(p);
+            cnt++;
+        }
+    }
+    release(&q->lock);
+    return cnt;
+}
+
+/*
+ * Kill the other processes sharing address space vm with the current
+ * one, i.e. its threads. They exit on their way back to user space.
+ * Those running are interrupted and those waiting on futexes are woken
+ * up, while sleeps elsewhere are not interrupted. Their wait status
+ * becomes xstate.
+ */
+void
+kill_threads(struct vmspace *vm, int xstate)
+{
+    struct proc *cp = thisproc(), *p, *np;
+
+    acquire(&ptable.lock);
+    LIST_FOREACH_ENTRY(p, &ptable.procs, plink) {
+        if (p->vm == vm && p != cp && p->state != ZOMBIE) {
+            p->killed = 1;
+            p->xstate = xstate;
+            if (p->state == RUNNING)
+                ipi_send(p->cpu, IPI_RESCHED);
+        }
+    }
     release(&ptable.lock);
+
+    /* A futex waiter either sees killed or is found here. */
+    for (struct sleepq * q = ptable.slpque; q < ptable.slpque + SQSIZE; q++) {
+        acquire(&q->lock);
+        LIST_FOREACH_ENTRY_SAFE(p, np, &q->que, link) {
+            if (p->vm == vm && (uint64_t) p->chan < USERTOP) {
+                wakeup_proc(p);
+            }
+        }
+        release(&q->lock);
+    }
 }
 
 /*
@@ -287,22 +736,21 @@ fork()
         return -1;
     }
 
-    if ((np->pgdir = uvm_copy(cp->pgdir)) == 0) {
-        kfree(np->kstack);
-
+    if ((np->vm = vmspace_copy(cp->vm)) == 0) {
         acquire(&ptable.lock);
-        np->state = UNUSED;
+        proc_free(np);
         release(&ptable.lock);
 
-        debug("uvm_copy returns null");
+        debug("vmspace_copy returns null");
         return -1;
     }
 
     np->parent = cp;
-
-    np->base = cp->base;
-    np->sz = cp->sz;
-    np->stksz = cp->stksz;
+    np->policy = cp->policy;
+    np->nice = cp->nice;
+    np->level = prio_base(np);
+    np->affinity = cp->affinity;
+    np->cpu = cp->cpu;
 
     memmove(np->tf, cp->tf, sizeof(*np->tf));
 
@@ -316,57 +764,167 @@ fork()
 
     int pid = np->pid;
 
-    acquire(&ptable.lock);
+    acquire(&ptable.treelock);
     list_push_back(&cp->child, &np->clink);
-    list_push_back(&ptable.sched_que, &np->link);
     np->state = RUNNABLE;
-    release(&ptable.lock);
+    release(&ptable.treelock);
+    runq_push(thiscpu(), np);
 
     trace("'%s'(%d) fork '%s'(%d)", cp->name, cp->pid, np->name, np->pid);
 
     return pid;
 }
 
+/*
+ * Create a thread sharing the address space of the current process,
+ * which starts on user stack stack as if returning from clone().
+ * Flags are those of clone(), of which CLONE_SETTLS,
+ * CLONE_PARENT_SETTID and CLONE_CHILD_CLEARTID are handled here.
+ * Return the pid of the thread, or -1 if out of memory.
+ */
+int
+clone_thread(uint64_t flags, void *stack, int *ptid, void *tls, int *ctid)
+{
+    struct proc *cp = thisproc();
+    struct vmspace *vm = cp->vm;
+    struct proc *np = proc_alloc();
+    if (np == 0) {
+        debug("proc_alloc returns null");
+        return -1;
+    }
+
+    int pid = np->pid;
+    if ((flags & CLONE_PARENT_SETTID) &&
+        (!in_user(ptid, sizeof(*ptid)) ||
+         uvm_prefault(vm, ptid, sizeof(*ptid)) < 0)) {
+        acquire(&ptable.lock);
+        proc_free(np);
+        release(&ptable.lock);
+        return -1;
+    }
+
+    __atomic_add_fetch(&vm->ref, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&vm->users, 1, __ATOMIC_RELAXED);
+    np->vm = vm;
+    np->thread = 1;
+    np->policy = cp->policy;
+    np->nice = cp->nice;
+    np->level = prio_base(np);
+    np->affinity = cp->affinity;
+    np->cpu = cp->cpu;
+
+    memmove(np->tf, cp->tf, sizeof(*np->tf));
+    np->tf->x[0] = 0;
+    np->tf->sp = (uint64_t) stack;
+    if (flags & CLONE_SETTLS)
+        np->tf->tpidr = (uint64_t) tls;
+    if (flags & CLONE_CHILD_CLEARTID)
+        np->clear_tid = ctid;
+    if (flags & CLONE_PARENT_SETTID)
+        *ptid = pid;
+
+    /* File tables are copied rather than shared. */
+    for (int i = 0; i < NOFILE; i++)
+        if (cp->ofile[i])
+            np->ofile[i] = filedup(cp->ofile[i]);
+    np->cwd = idup(cp->cwd);
+    safestrcpy(np->name, cp->name, sizeof(np->name));
+
+    np->state = RUNNABLE;
+    runq_push(thiscpu(), np);
+
+    trace("'%s'(%d) clone thread %d", cp->name, cp->pid, pid);
+    return pid;
+}
+
+
+static void
+usage_add(struct usage *ru, struct usage *x)
+{
+    ru->utime += x->utime;
+    ru->stime += x->stime;
+    ru->nvcsw += x->nvcsw;
+    ru->nivcsw += x->nivcsw;
+}
 
 /*
- * Wait for a child process to exit and return its pid.
- * Return -1 if this process has no children.
+ * Wait for child process pid, or any child if pid is -1, to exit
+ * and return its pid. If status is not null, store its wait status
+ * there. If ru is not null, store the resources used by the child
+ * and its waited-for children there.
+ * Return 0 if nohang and no such child has exited yet, and -1 if
+ * this process has no such child.
  */
 int
-wait()
+wait(int pid, int *status, int nohang, struct usage *ru)
 {
     struct proc *cp = thisproc();
 
     struct list_head *q = &cp->child;
     struct proc *p, *np;
+    int found;
 
-    acquire(&ptable.lock);
-    while (!list_empty(q)) {
+    acquire(&ptable.treelock);
+    for (;;) {
+        found = 0;
         LIST_FOREACH_ENTRY_SAFE(p, np, q, clink) {
+            if (pid != -1 && p->pid != pid)
+                continue;
+            found = 1;
             if (p->state == ZOMBIE) {
                 assert(p->parent == cp);
 
                 list_drop(&p->clink);
-
-                kfree(p->kstack);
-                vm_free(p->pgdir);
-                p->state = UNUSED;
-
-                int pid = p->pid;
+                release(&ptable.treelock);
+
+                /* Wait until p has switched out. */
+                acquire(&p->lock);
+                release(&p->lock);
+
+                pid = p->pid;
+                usage_add(&p->ru, &p->cru);
+                usage_add(&cp->cru, &p->ru);
+                if (status)
+                    *status = p->xstate;
+                if (ru)
+                    *ru = p->ru;
+                vmspace_put(p->vm);
+
+                acquire(&ptable.lock);
+                proc_free(p);
                 release(&ptable.lock);
                 return pid;
             }
         }
-        sleep(cp, &ptable.lock);
+        if (!found || nohang)
+            break;
+        sleep(cp, &ptable.treelock);
     }
+    release(&ptable.treelock);
+    return found ? 0 : -1;
+}
+
+/* Free an exited thread, which has no parent to wait for it. */
+static void
+proc_reap(struct work *w)
+{
+    struct proc *p = container_of(w, struct proc, reap);
+
+    /* Wait until p has switched out. */
+    acquire(&p->lock);
+    release(&p->lock);
+
+    vmspace_put(p->vm);
+    acquire(&ptable.lock);
+    proc_free(p);
     release(&ptable.lock);
-    return -1;
 }
 
 /*
  * Exit the current process.  Does not return.
  * An exited process remains in the zombie state
  * until its parent calls wait() to find out it exited.
+ * An exited thread is freed by a kernel worker instead.
  */
 void
 exit(int err)
@@ -375,9 +933,22 @@ exit(int err)
     if (cp == initproc)
         panic("init exit");
 
-    if (err) {
+    if (err && !cp->killed) {
         warn("exit: pid %d, err %d", cp->pid, err);
     }
+    if (!cp->killed)
+        cp->xstate = (err & 0xff) << 8;
+
+    // Tell the joining thread, as CLONE_CHILD_CLEARTID requires.
+    if (cp->clear_tid && in_user(cp->clear_tid, sizeof(*cp->clear_tid))
+        && uvm_prefault(cp->vm, cp->clear_tid, sizeof(*cp->clear_tid)) == 0) {
+        int zero = 0;
+        acquire(&cp->vm->lock);
+        int r = copyout(cp->vm->pgdir, cp->clear_tid, &zero, sizeof(zero));
+        release(&cp->vm->lock);
+        if (r == 0)
+            futex_wake(cp->clear_tid, 1);
+    }
 
     // Close all open files.
     for (int fd = 0; fd < NOFILE; fd++) {
@@ -387,15 +958,19 @@ exit(int err)
         }
     }
 
+    uvm_sysexit(cp);
     begin_op();
     iput(cp->cwd);
+    vmspace_exit(cp->vm);
     end_op();
     cp->cwd = 0;
 
-    acquire(&ptable.lock);
+    acquire(&cp->lock);
+    acquire(&ptable.treelock);
 
     // Parent might be sleeping in wait().
-    wakeup1(cp->parent);
+    if (cp->parent)
+        wakeup(cp->parent);
 
     // Pass abandoned children to init.
     struct list_head *q = &cp->child;
@@ -407,17 +982,151 @@ exit(int err)
         list_drop(&p->clink);
         list_push_back(&initproc->child, &p->clink);
         if (p->state == ZOMBIE)
-            wakeup1(initproc);
+            wakeup(initproc);
     }
     assert(list_empty(q));
 
     // Jump into the scheduler, never to return.
     cp->state = ZOMBIE;
+    release(&ptable.treelock);
+    if (cp->thread) {
+        work_init(&cp->reap, proc_reap);
+        work_queue(&cp->reap);
+    }
 
     swtch(&cp->context, thiscpu()->scheduler);
     panic("zombie exit");
 }
 
+/*
+ * Find process pid, or the current process if pid is 0.
+ * The ptable lock must be held.
+ */
+static struct proc *
+proc_find(int pid)
+{
+    struct proc *p;
+    if (pid == 0)
+        return thisproc();
+    LIST_FOREACH_ENTRY(p, &ptable.pidhash[pid & (PIDHASH - 1)], hlink) {
+        if (p->pid == pid && p->state != ZOMBIE)
+            return p;
+    }
+    return 0;
+}
+
+/*
+ * Kill process pid, which exits on its way back to user space.
+ * It is woken up if sleeping, and those sleeps that should be
+ * interrupted check p->killed then. If probe, only check that
+ * it could be killed, as kill(pid, 0) does.
+ * Return 0 on success, -1 if no such user process.
+ */
+int
+kill(int pid, int probe)
+{
+    acquire(&ptable.lock);
+    struct proc *p = pid > 0 ? proc_find(pid) : 0;
+    if (p && !p->vm)
+        p = 0;                  /* Kernel threads never die. */
+    if (p && !probe) {
+        p->killed = 1;
+        p->xstate = 9;          /* Terminated by SIGKILL. */
+        void *chan = p->chan;
+        struct sleepq *q = &ptable.slpque[HASH(chan)];
+        acquire(&q->lock);
+        if (p->state == SLEEPING && p->chan == chan)
+            wakeup_proc(p);
+        release(&q->lock);
+        if (p->state == RUNNING && p != thisproc())
+            ipi_send(p->cpu, IPI_RESCHED);
+    }
+    release(&ptable.lock);
+    return p ? 0 : -1;
+}
+
+/*
+ * Set scheduling policy and nice value of process pid, where a negative
+ * policy or a nice out of [-20, 19], e.g. NICE_KEEP, is left unchanged.
+ * Return 0 on success and -1 if no such process or policy.
+ */
+int
+sched_set(int pid, int policy, int nice)
+{
+    if (policy >= 0 && policy != SCHED_OTHER && policy != SCHED_BATCH
+        && policy != SCHED_IDLE)
+        return -1;
+
+    acquire(&ptable.lock);
+    struct proc *p = proc_find(pid);
+    if (p) {
+        if (policy >= 0)
+            p->policy = policy;
+        if (-20 <= nice && nice < 20)
+            p->nice = nice;
+        /* Takes effect when queued next time. */
+        p->level = prio_base(p);
+    }
+    release(&ptable.lock);
+    return p ? 0 : -1;
+}
+
+/* Get scheduling policy and nice value of process pid. */
+int
+sched_get(int pid, int *policy, int *nice)
+{
+    acquire(&ptable.lock);
+    struct proc *p = proc_find(pid);
+    if (p) {
+        *policy = p->policy;
+        *nice = p->nice;
+    }
+    release(&ptable.lock);
+    return p ? 0 : -1;
+}
+
+/*
+ * Set the cpus process pid is allowed to run on to mask, where bit i
+ * stands for cpu i. Return 0 on success and -1 if no such process or
+ * no valid cpu in mask.
+ */
+int
+affinity_set(int pid, uint64_t mask)
+{
+    mask &= (1 << NCPU) - 1;
+    if (!mask)
+        return -1;
+
+    acquire(&ptable.lock);
+    struct proc *p = proc_find(pid);
+    if (p && !p->vm)
+        p = 0;                  /* Kernel threads are pinned. */
+    if (p) {
+        p->affinity = mask;
+        /* Move it to an allowed cpu when it switches out, or now. */
+        if (p == thisproc() && !cpu_allowed(p, thiscpu()))
+            thiscpu()->resched = 1;
+        else if (p->state == RUNNING && !cpu_allowed(p, &cpu[p->cpu]))
+            ipi_send(p->cpu, IPI_RESCHED);
+        else
+            runq_migrate(p);
+    }
+    release(&ptable.lock);
+    return p ? 0 : -1;
+}
+
+/* Get the cpus process pid is allowed to run on. */
+int
+affinity_get(int pid, uint64_t *mask)
+{
+    acquire(&ptable.lock);
+    struct proc *p = proc_find(pid);
+    if (p)
+        *mask = p->affinity;
+    release(&ptable.lock);
+    return p ? 0 : -1;
+}
+
 /*
  * Print a process listing to console. For debugging.
  * Runs when user types ^P on console.
@@ -435,16 +1144,32 @@ procdump()
     };
     struct proc *p;
 
-    // Donot acquire ptable.lock to avoid deadlock
-    // acquire(&ptable.lock);
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-        if (p->state == UNUSED)
-            continue;
+    /*
+     * Exited processes are freed under ptable.lock, so hold it while
+     * walking the list. Interrupts only arrive from user space or
+     * cpu_idle(), where no spinlock is held, so this cannot deadlock.
+     */
+    acquire(&ptable.lock);
+    uint64_t ms = timerfreq() / 1000;
+    LIST_FOREACH_ENTRY(p, &ptable.procs, plink) {
         if (p->parent)
-            cprintf("%d %s %s fa: %d\n", p->pid, states[p->state], p->name,
+            cprintf("%d %s %s fa: %d", p->pid, states[p->state], p->name,
                     p->parent->pid);
         else
-            cprintf("%d %s %s\n", p->pid, states[p->state], p->name);
+            cprintf("%d %s %s", p->pid, states[p->state], p->name);
+        cprintf(" lv %d nice %d, %lld ms, %lld/%lld csw, cpu %d/0x%llx, "
+                "%lld migrations\n", p->level, p->nice,
+                (p->ru.utime + p->ru.stime) / ms, p->ru.nvcsw,
+                p->ru.nivcsw, p->cpu, p->affinity, p->nmigrate);
     }
-    // release(&ptable.lock);
+    release(&ptable.lock);
+
+    for (int i = 0; i < NCPU; i++)
+        cprintf("cpu %d: %d runnable, %lld scheduled, %lld stolen, "
+                "%lld%% idle\n", i, cpu[i].nrunnable, cpu[i].nswtch,
+                cpu[i].nsteal, cpu[i].idletime * 100 / (timestamp() + 1));
+    for (int i = 0; i < NCPU; i++)
+        cprintf("cpu %d: %lld ipis\n", i, cpu[i].nipi);
+    lat_dump("wakeup", offsetof(struct cpu, wakelat));
+    lat_dump("preempt", offsetof(struct cpu, runlat));
 }
@@ -0,0 +1,181 @@
+/*
+ * Slab allocator.
+ *
+ * A kmem_cache hands out objects of a fixed size. Objects are carved
+ * from slabs, each of which is a single page obtained by kalloc().
+ * Free objects of a slab are linked through their first word and the
+ * slab itself is described by the page descriptor of its page, so
+ * that kfree() can find the cache of an object by its address.
+ *
+ * Slabs with free objects are kept on the partial list of the cache,
+ * thus both allocation and free are O(1).
+ *
+ * kmalloc() is built upon a set of caches of power-of-2 sizes, while
+ * larger requests are served by the buddy allocator directly.
+ */
+
+#include "mm.h"
+
+#include "types.h"
+#include "string.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "console.h"
+
+#define KMALLOC_MIN     16
+#define KMALLOC_MAX     2048
+
+static struct kmem_cache kmalloc_caches[] = {
+    { .name = "kmalloc-16",   .size = 16   },
+    { .name = "kmalloc-32",   .size = 32   },
+    { .name = "kmalloc-64",   .size = 64   },
+    { .name = "kmalloc-128",  .size = 128  },
+    { .name = "kmalloc-256",  .size = 256  },
+    { .name = "kmalloc-512",  .size = 512  },
+    { .name = "kmalloc-1024", .size = 1024 },
+    { .name = "kmalloc-2048", .size = 2048 },
+};
+
+/* All caches, for statistics. */
+static struct list_head caches;
+static struct spinlock cacheslock;
+
+void
+kmem_cache_init(struct kmem_cache *c, const char *name, size_t size)
+{
+    c->name = name;
+    c->size = ROUNDUP(MAX(size, sizeof(void *)), KMALLOC_MIN);
+    c->nobj = PGSIZE / c->size;
+    assert(c->nobj > 0);
+    list_init(&c->partial);
+    initlock(&c->lock, "kmem_cache");
+    c->nalloc = c->nfree = c->nslab = 0;
+
+    acquire(&cacheslock);
+    list_push_back(&caches, &c->link);
+    release(&cacheslock);
+}
+
+/* Make a new slab for cache c. Returns 0 if out of memory. */
+static struct page *
+slab_new(struct kmem_cache *c)
+{
+    void *p = kalloc();
+    if (!p)
+        return 0;
+
+    struct page *pg = va2page(p);
+    pg->flags |= PG_SLAB;
+    pg->cache = c;
+    pg->inuse = 0;
+    pg->freelist = 0;
+    for (int i = c->nobj - 1; i >= 0; i--) {
+        void *obj = p + i * c->size;
+        *(void **)obj = pg->freelist;
+        pg->freelist = obj;
+    }
+    return pg;
+}
+
+/* Allocate an object from cache c. Returns 0 if out of memory. */
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+    acquire(&c->lock);
+    if (list_empty(&c->partial)) {
+        struct page *pg = slab_new(c);
+        if (!pg) {
+            release(&c->lock);
+            return 0;
+        }
+        list_push_front(&c->partial, &pg->link);
+        c->nslab++;
+    }
+
+    struct page *pg =
+        container_of(list_front(&c->partial), struct page, link);
+    void *obj = pg->freelist;
+    pg->freelist = *(void **)obj;
+    if (++pg->inuse == c->nobj)
+        list_drop(&pg->link);
+    c->nalloc++;
+    release(&c->lock);
+    return obj;
+}
+
+/* Free an object allocated from cache c. */
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+    struct page *pg = va2page(obj);
+    assert((pg->flags & PG_SLAB) && pg->cache == c);
+
+    acquire(&c->lock);
+    *(void **)obj = pg->freelist;
+    pg->freelist = obj;
+    if (pg->inuse-- == c->nobj)
+        list_push_front(&c->partial, &pg->link);
+    c->nfree++;
+
+    /* Release an empty slab unless it is the only one left. */
+    if (pg->inuse == 0 && list_front(&c->partial) != list_back(&c->partial)) {
+        list_drop(&pg->link);
+        c->nslab--;
+    } else
+        pg = 0;
+    release(&c->lock);
+
+    if (pg) {
+        pg->flags &= ~PG_SLAB;
+        kfree(page2va(pg));
+    }
+}
+
+/*
+ * Allocate size bytes of memory.
+ * Returns 0 if failed else a pointer, which should be freed by kfree().
+ */
+void *
+kmalloc(size_t size)
+{
+    if (size <= KMALLOC_MAX) {
+        struct kmem_cache *c = kmalloc_caches;
+        while (c->size < size)
+            c++;
+        return kmem_cache_alloc(c);
+    }
+
+    int order = 0;
+    while ((PGSIZE << order) < size)
+        order++;
+    void *p = kalloc_pages(order);
+    if (p) {
+        struct page *pg = va2page(p);
+        pg->flags |= PG_LARGE;
+        pg->order = order;
+    }
+    return p;
+}
+
+void
+slab_init()
+{
+    initlock(&cacheslock, "kmem_caches");
+    list_init(&caches);
+    for (int i = 0; i < ARRAY_SIZE(kmalloc_caches); i++) {
+        struct kmem_cache *c = &kmalloc_caches[i];
+        kmem_cache_init(c, c->name, c->size);
+    }
+}
+
+void
+slab_dump()
+{
+    struct kmem_cache *c;
+    acquire(&cacheslock);
+    LIST_FOREACH_ENTRY(c, &caches, link) {
+        cprintf("%s: size %lld, %lld in use, %lld slabs\n", c->name,
+                c->size, c->nalloc - c->nfree, c->nslab);
+    }
+    release(&cacheslock);
+}
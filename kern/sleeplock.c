@@ -1,42 +1,124 @@
 #include "sleeplock.h"
+#include "console.h"
 
+/* The spinlock lk is accounted under the class of the sleeplock. */
 void
-initsleeplock(struct sleeplock *lk, char *name)
+initsleeplock1(struct sleeplock *lk, struct lockclass *class)
 {
-    initlock(&lk->lk);
+    initlock1(&lk->lk, class);
     lk->locked = 0;
+    lk->nwait = 0;
     lk->pid = 0;
 }
 
+static int
+trylock(struct sleeplock *lk)
+{
+    int unlocked = 0;
+    return __atomic_compare_exchange_n(&lk->locked, &unlocked, 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/*
+ * A waiter counts itself in nwait before its last try, and the holder
+ * checks nwait after unlocking, so that either the waiter gets the lock
+ * or the holder sees it and wakes it up.
+ */
 void
 acquiresleep(struct sleeplock *lk)
 {
-    acquire(&lk->lk);
-    while (lk->locked) {
-        sleep(lk, &lk->lk);
+    if (!trylock(lk)) {
+        acquire(&lk->lk);
+        __atomic_add_fetch(&lk->nwait, 1, __ATOMIC_SEQ_CST);
+        while (!trylock(lk))
+            sleep(lk, &lk->lk);
+        lk->nwait--;
+        release(&lk->lk);
     }
-    lk->locked = 1;
     lk->pid = thisproc()->pid;
-    release(&lk->lk);
 }
 
 void
 releasesleep(struct sleeplock *lk)
 {
-    acquire(&lk->lk);
-    lk->locked = 0;
     lk->pid = 0;
-    wakeup(lk);
-    release(&lk->lk);
+    __atomic_store_n(&lk->locked, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lk->nwait, __ATOMIC_SEQ_CST)) {
+        acquire(&lk->lk);
+        wakeup(lk);
+        release(&lk->lk);
+    }
 }
 
 int
 holdingsleep(struct sleeplock *lk)
 {
-    int r;
+    return lk->locked && lk->pid == thisproc()->pid;
+}
 
+void
+initrwsleeplock1(struct rwsleeplock *lk, struct lockclass *class)
+{
+    initlock1(&lk->lk, class);
+    lk->readers = lk->writer = lk->wwait = 0;
+}
+
+void
+acquireread(struct rwsleeplock *lk)
+{
+    acquire(&lk->lk);
+    while (lk->writer || lk->wwait)
+        sleep(lk, &lk->lk);
+    lk->readers++;
+    release(&lk->lk);
+}
+
+void
+releaseread(struct rwsleeplock *lk)
+{
     acquire(&lk->lk);
-    r = lk->locked && (lk->pid == thisproc()->pid);
+    if (lk->readers < 1)
+        panic("releaseread");
+    if (--lk->readers == 0 && lk->wwait)
+        wakeup(lk);
     release(&lk->lk);
-    return r;
+}
+
+void
+acquirewrite(struct rwsleeplock *lk)
+{
+    acquire(&lk->lk);
+    lk->wwait++;
+    while (lk->writer || lk->readers)
+        sleep(lk, &lk->lk);
+    lk->wwait--;
+    lk->writer = thisproc()->pid;
+    release(&lk->lk);
+}
+
+void
+releasewrite(struct rwsleeplock *lk)
+{
+    acquire(&lk->lk);
+    lk->writer = 0;
+    wakeup(lk);
+    release(&lk->lk);
+}
+
+/* Turn the write lock held into a read lock without letting others in. */
+void
+downgradewrite(struct rwsleeplock *lk)
+{
+    acquire(&lk->lk);
+    lk->writer = 0;
+    lk->readers++;
+    if (!lk->wwait)
+        wakeup(lk);
+    release(&lk->lk);
+}
+
+int
+holdingwrite(struct rwsleeplock *lk)
+{
+    return lk->writer == thisproc()->pid;
 }
@@ -2,23 +2,94 @@
 #include "spinlock.h"
 #include "console.h"
 
+/* All lock classes, pushed by initlock1() without any lock. */
+static struct lockclass *classes;
+
 void
-initlock(struct spinlock *lk)
+initlock1(struct spinlock *lk, struct lockclass *class)
+{
+    lk->owner = lk->next = 0;
+    lk->cpu = -1;
+    lk->class = class;
+    if (!__atomic_exchange_n(&class->registered, 1, __ATOMIC_RELAXED)) {
+        class->next = __atomic_load_n(&classes, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&classes, &class->next, class, 0,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) ;
+    }
+}
+
+/*
+ * Whether this cpu holds lk. The holder clears lk->cpu before passing
+ * the lock on, so a stale cpu is never seen while someone else holds it.
+ */
+int
+holding(struct spinlock *lk)
 {
-    lk->locked = 0;
+    return lk->owner != lk->next && lk->cpu == cpuid();
 }
 
+/*
+ * Take a ticket and wait for its turn by wfe, which is woken up by the
+ * sev in release(). Interrupts need not be disabled since the kernel
+ * always runs with them masked.
+ */
 void
 acquire(struct spinlock *lk)
 {
-    while (lk->locked
-           || __atomic_test_and_set(&lk->locked, __ATOMIC_ACQUIRE)) ;
+    if (holding(lk))
+        panic("acquire: %s held\n", lk->class ? lk->class->name : "lock");
+
+    uint16_t t = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+    uint64_t now = lk->class ? timestamp() : 0;
+    int contended = 0;
+    while (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != t) {
+        contended = 1;
+        wfe();
+    }
+    lk->cpu = cpuid();
+
+    if (lk->class) {
+        struct lockstat *s = &lk->class->stat[lk->cpu];
+        lk->start = timestamp();
+        s->nacquire++;
+        if (contended) {
+            s->ncontend++;
+            s->wait += lk->start - now;
+        }
+    }
 }
 
 void
 release(struct spinlock *lk)
 {
-    if (!lk->locked)
-        panic("release: not locked\n");
-    __atomic_clear(&lk->locked, __ATOMIC_RELEASE);
+    if (!holding(lk))
+        panic("release: %s not held\n",
+              lk->class ? lk->class->name : "lock");
+
+    if (lk->class)
+        lk->class->stat[lk->cpu].hold += timestamp() - lk->start;
+    lk->cpu = -1;
+    __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
+    sev();
+}
+
+/* Print statistics of lock classes that have been acquired. */
+void
+lock_dump()
+{
+    uint64_t us = timerfreq() / 1000000;
+    for (struct lockclass * c = classes; c; c = c->next) {
+        struct lockstat t = { 0 };
+        for (int i = 0; i < NCPU; i++) {
+            t.nacquire += c->stat[i].nacquire;
+            t.ncontend += c->stat[i].ncontend;
+            t.wait += c->stat[i].wait;
+            t.hold += c->stat[i].hold;
+        }
+        if (t.nacquire)
+            cprintf("lock %s: %lld acquired, %lld contended, "
+                    "%lld us waited, %lld us held\n", c->name, t.nacquire,
+                    t.ncontend, t.wait / us, t.hold / us);
+    }
 }
@@ -7,11 +7,23 @@
 #include "console.h"
 #include "proc.h"
 #include "debug.h"
+#include "vm.h"
 
 extern int sys_brk();
 extern int sys_mmap();
+extern int sys_munmap();
+extern int sys_mprotect();
 extern int sys_wait4();
 extern int sys_yield();
+extern int sys_kill();
+extern int sys_getrusage();
+extern int sys_setpriority();
+extern int sys_getpriority();
+extern int sys_sched_setscheduler();
+extern int sys_sched_getscheduler();
+extern int sys_sched_setaffinity();
+extern int sys_sched_getaffinity();
+extern int sys_clock_gettime();
 
 extern int sys_execve();
 
@@ -19,6 +31,9 @@ extern int sys_dup();
 extern int sys_chdir();
 extern int sys_pipe2();
 extern int sys_clone();
+extern int sys_futex();
+extern int sys_set_tid_address();
+extern int sys_exit_group();
 extern int sys_fstat();
 extern int sys_fstatat();
 extern int sys_open();
@@ -29,16 +44,12 @@ extern int sys_close();
 extern int sys_writev();
 extern int sys_read();
 
-/* Check if a block of memory lies within the process user space. */
+/* Check if a block of memory lies within a region of user space. */
 int
 in_user(void *s, size_t n)
 {
-    struct proc *p = thisproc();
-    if ((p->base <= (uint64_t) s && (uint64_t) s + n <= p->sz) ||
-        (USERTOP - p->stksz <= (uint64_t) s
-         && (uint64_t) s + n <= USERTOP))
-        return 1;
-    return 0;
+    size_t end = uvm_region(thisproc()->vm, (size_t)s);
+    return end && (size_t)s + n >= (size_t)s && (size_t)s + n <= end;
 }
 
 /*
@@ -49,17 +60,17 @@ in_user(void *s, size_t n)
 int
 fetchstr(uint64_t addr, char **pp)
 {
-    struct proc *p = thisproc();
     char *s;
     *pp = s = (char *)addr;
-    if (p->base <= addr && addr < p->sz) {
-        for (; (uint64_t) s < p->sz; s++)
-            if (*s == 0)
-                return s - *pp;
-    } else if (USERTOP - p->stksz <= addr && addr < USERTOP) {
-        for (; (uint64_t) s < USERTOP; s++)
-            if (*s == 0)
-                return s - *pp;
+    struct vmspace *vm = thisproc()->vm;
+    size_t end = uvm_region(vm, addr);
+    for (; (uint64_t) s < end; s++) {
+        /* Fault in each page, which might be unmapped meanwhile. */
+        if ((s == *pp || ((uint64_t) s & (PGSIZE - 1)) == 0)
+            && uvm_prefault(vm, s, 1) < 0)
+            return -1;
+        if (*s == 0)
+            return s - *pp;
     }
     return -1;
 }
@@ -112,7 +123,14 @@ argptr(int n, char **pp, size_t size)
     if (argu64(n, &i) < 0) {
         return -1;
     }
-    if (in_user((void *)i, size)) {
+    /*
+     * Map the block now since the kernel might access it later
+     * while holding spinlocks, where page faults must not sleep.
+     * It stays mapped until the system call returns, even if
+     * another thread unmaps it, see uvm_munmap().
+     */
+    if (in_user((void *)i, size)
+        && uvm_prefault(thisproc()->vm, (void *)i, size) == 0) {
         *pp = (char *)i;
         return 0;
     } else {
@@ -123,8 +141,8 @@ argptr(int n, char **pp, size_t size)
 /*
  * Fetch the nth word-sized system call argument as a string pointer.
  * Check that the pointer is valid and the string is nul-terminated.
- * (There is no shared writable memory, so the string can't change
- * between this check and being used by the kernel.)
+ * (Threads sharing the memory might change the string after this
+ * check, which only harms themselves.)
  */
 int
 argstr(int n, char **pp)
@@ -143,10 +161,8 @@ syscall1(struct trapframe *tf)
     int sysno = tf->x[8];
     switch (sysno) {
 
-        // FIXME: use pid instead of tid since we don't have threads :)
     case SYS_set_tid_address:
-        trace("set_tid_address: name '%s'", thisproc()->name);
-        return thisproc()->pid;
+        return sys_set_tid_address();
     case SYS_gettid:
         trace("gettid: name '%s'", thisproc()->name);
         return thisproc()->pid;
@@ -169,21 +185,46 @@ syscall1(struct trapframe *tf)
         return sys_brk();
     case SYS_mmap:
         return sys_mmap();
+    case SYS_munmap:
+        return sys_munmap();
+    case SYS_mprotect:
+        return sys_mprotect();
 
     case SYS_execve:
         return sys_execve();
 
     case SYS_sched_yield:
         return sys_yield();
+    case SYS_kill:
+        return sys_kill();
+    case SYS_getrusage:
+        return sys_getrusage();
+    case SYS_setpriority:
+        return sys_setpriority();
+    case SYS_getpriority:
+        return sys_getpriority();
+    case SYS_sched_setscheduler:
+        return sys_sched_setscheduler();
+    case SYS_sched_getscheduler:
+        return sys_sched_getscheduler();
+    case SYS_sched_setaffinity:
+        return sys_sched_setaffinity();
+    case SYS_sched_getaffinity:
+        return sys_sched_getaffinity();
+
+    case SYS_clock_gettime:
+        return sys_clock_gettime();
 
     case SYS_clone:
         return sys_clone();
+    case SYS_futex:
+        return sys_futex();
 
     case SYS_wait4:
         return sys_wait4();
 
-        // FIXME: exit_group should kill every thread in the current thread group.
     case SYS_exit_group:
+        return sys_exit_group();
     case SYS_exit:
         trace("sys_exit: '%s' exit with code %d", thisproc()->name,
               tf->x[0]);
@@ -16,6 +16,7 @@
 #include "log.h"
 #include "fs.h"
 #include "file.h"
+#include "vm.h"
 
 extern int execve(const char *, char *const, char *const);
 
@@ -118,7 +119,8 @@ sys_writev()
 
     size_t tot = 0;
     for (p = iov; p < iov + iovcnt; p++) {
-        if (!in_user(p->iov_base, p->iov_len))
+        if (!in_user(p->iov_base, p->iov_len)
+            || uvm_prefault(thisproc()->vm, p->iov_base, p->iov_len) < 0)
             return -1;
         tot += filewrite(f, p->iov_base, p->iov_len);
     }
@@ -178,7 +180,7 @@ sys_fstatat()
         end_op();
         return -1;
     }
-    ilock(ip);
+    ilock_shared(ip);
     stati(ip, st);
     iunlockput(ip);
     end_op();
@@ -483,7 +485,7 @@ sys_chdir()
         end_op();
         return -1;
     }
-    ilock(ip);
+    ilock_shared(ip);
     if (ip->type != T_DIR) {
         iunlockput(ip);
         end_op();
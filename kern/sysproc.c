@@ -1,9 +1,53 @@
+#define _GNU_SOURCE             /* For CLONE_* in <sched.h>. */
+
 #include "proc.h"
 #include "trap.h"
 #include "console.h"
 #include "vm.h"
 
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <time.h>
+
+/* From <linux/futex.h>, which musl does not provide. */
+#define FUTEX_WAIT              0
+#define FUTEX_WAKE              1
+#define FUTEX_PRIVATE_FLAG      128
+
+/* From <sys/wait.h>, whose wait() clashes with ours. */
+#define WNOHANG                 1
+#define WUNTRACED               2
+#define WCONTINUED              8
+
+/* Both clocks count from boot using the physical timer. */
+int
+sys_clock_gettime()
+{
+    int clk;
+    struct timespec *tp;
+    if (argint(0, &clk) < 0
+        || argptr(1, (char **)&tp, sizeof(*tp)) < 0)
+        return -1;
+    if (clk != CLOCK_REALTIME && clk != CLOCK_MONOTONIC) {
+        warn("clock %d unimplemented", clk);
+        return -1;
+    }
+    uint64_t f = timerfreq(), t = timestamp();
+    tp->tv_sec = t / f;
+    tp->tv_nsec = t % f * 1000000000 / f;
+    return 0;
+}
+
+/* Without signals, any signal but 0 kills. */
+int
+sys_kill()
+{
+    int pid, sig;
+    if (argint(0, &pid) < 0 || argint(1, &sig) < 0 || sig < 0)
+        return -1;
+    return kill(pid, sig == 0);
+}
 
 int
 sys_yield()
@@ -12,31 +56,105 @@ sys_yield()
     return 0;
 }
 
+int
+sys_setpriority()
+{
+    int which, who, prio;
+    if (argint(0, &which) < 0 || argint(1, &who) < 0
+        || argint(2, &prio) < 0 || which != PRIO_PROCESS)
+        return -1;
+    return sched_set(who, -1, MIN(MAX(prio, -20), 19));
+}
+
+/* Return 20 - nice as Linux does, which is converted back by libc. */
+int
+sys_getpriority()
+{
+    int which, who, policy, nice;
+    if (argint(0, &which) < 0 || argint(1, &who) < 0
+        || which != PRIO_PROCESS || sched_get(who, &policy, &nice) < 0)
+        return -1;
+    return 20 - nice;
+}
+
+/* Only the non-realtime policies are supported, at static priority 0. */
+int
+sys_sched_setscheduler()
+{
+    int pid, policy;
+    struct sched_param *param;
+    if (argint(0, &pid) < 0 || argint(1, &policy) < 0
+        || argptr(2, (char **)&param, sizeof(*param)) < 0
+        || policy < 0 || param->sched_priority != 0)
+        return -1;
+    return sched_set(pid, policy, NICE_KEEP);
+}
+
+/* Cpu masks are copied as a single 64-bit word. */
+int
+sys_sched_setaffinity()
+{
+    int pid, len;
+    uint64_t *mask;
+    if (argint(0, &pid) < 0 || argint(1, &len) < 0
+        || len < (int)sizeof(*mask)
+        || argptr(2, (char **)&mask, sizeof(*mask)) < 0)
+        return -1;
+    return affinity_set(pid, *mask);
+}
+
+/* Return the number of bytes written as Linux does. */
+int
+sys_sched_getaffinity()
+{
+    int pid, len;
+    uint64_t *mask;
+    if (argint(0, &pid) < 0 || argint(1, &len) < 0
+        || len < (int)sizeof(*mask)
+        || argptr(2, (char **)&mask, sizeof(*mask)) < 0
+        || affinity_get(pid, mask) < 0)
+        return -1;
+    return sizeof(*mask);
+}
+
+int
+sys_sched_getscheduler()
+{
+    int pid, policy, nice;
+    if (argint(0, &pid) < 0 || sched_get(pid, &policy, &nice) < 0)
+        return -1;
+    return policy;
+}
+
 size_t
 sys_brk()
 {
-    struct proc *p = thisproc();
-    size_t sz, newsz, oldsz = p->sz;
+    struct vmspace *vm = thisproc()->vm;
+    size_t sz, newsz, oldsz = vm->sz;
 
     panic("sys_brk: unimplemented. ");
 
     if (argu64(0, &newsz) < 0)
         return oldsz;
 
-    trace("name %s: 0x%llx to 0x%llx", p->name, oldsz, newsz);
+    trace("name %s: 0x%llx to 0x%llx", thisproc()->name, oldsz, newsz);
 
     if (newsz == 0)
         return oldsz;
 
+    write_seqlock(&vm->layout);
+    acquire(&vm->lock);
     if (newsz < oldsz) {
-        p->sz = uvm_dealloc(p->pgdir, p->base, oldsz, newsz);
+        vm->sz = uvm_dealloc(vm->pgdir, vm->base, oldsz, newsz);
     } else {
-        sz = uvm_alloc(p->pgdir, p->base, p->stksz, oldsz, newsz);
-        if (sz == 0)
-            return oldsz;
-        p->sz = sz;
+        sz = uvm_alloc(vm->pgdir, vm->base, vm->stksz, oldsz, newsz);
+        if (sz)
+            vm->sz = sz;
     }
-    return p->sz;
+    sz = vm->sz;
+    release(&vm->lock);
+    write_sequnlock(&vm->layout);
+    return sz;
 }
 
 size_t
@@ -66,48 +184,186 @@ sys_mmap()
         trace("map none at 0x%p", addr);
         return (size_t)addr;
     } else {
-        if (prot != (PROT_READ | PROT_WRITE)) {
-            warn("non-rw unimplemented");
+        /*
+         * Protection is not enforced, so PROT_NONE mappings, e.g. thread
+         * stacks with guard pages, are readable and writable as well.
+         */
+        if (prot & PROT_EXEC) {
+            warn("exec mapping unimplemented");
             return -1;
         }
-        panic("unimplemented. ");
-        return -1;
+        addr = uvm_mmap(thisproc()->vm, len);
+        trace("map 0x%llx bytes at 0x%p", len, addr);
+        return addr ? (size_t)addr : -1;
     }
 }
 
+int
+sys_munmap()
+{
+    void *addr;
+    size_t len;
+    if (argu64(0, (uint64_t *) & addr) < 0 || argu64(1, &len) < 0)
+        return -1;
+    return uvm_munmap(thisproc()->vm, addr, len);
+}
+
+/* Accepted but not enforced, see sys_mmap(). */
+int
+sys_mprotect()
+{
+    void *addr;
+    size_t len;
+    if (argu64(0, (uint64_t *) & addr) < 0 || argu64(1, &len) < 0
+        || !in_user(addr, len))
+        return -1;
+    return 0;
+}
+
+/*
+ * Either fork, or create a thread in the same address space as
+ * pthread_create() does. The fd table, cwd and signal handlers are
+ * never shared, even if asked to.
+ */
 int
 sys_clone()
 {
-    void *childstk;
+    void *childstk, *tls;
     uint64_t flag;
-    if (argu64(0, &flag) < 0 || argu64(1, (uint64_t *) & childstk) < 0)
+    int *ptid, *ctid;
+    if (argu64(0, &flag) < 0 || argu64(1, (uint64_t *) & childstk) < 0
+        || argu64(2, (uint64_t *) & ptid) < 0
+        || argu64(3, (uint64_t *) & tls) < 0
+        || argu64(4, (uint64_t *) & ctid) < 0)
         return -1;
     trace("flags 0x%llx, child stack 0x%p", flag, childstk);
-    if (flag != 17) {
-        warn("flags other than SIGCHLD are not supported");
+    if (flag == 17)             /* SIGCHLD */
+        return fork();
+    if ((flag & (CLONE_VM | CLONE_THREAD)) != (CLONE_VM | CLONE_THREAD)
+        || (flag & CSIGNAL) || !childstk) {
+        warn("clone flags 0x%llx are not supported", flag);
         return -1;
     }
-    return fork();
+    return clone_thread(flag, childstk, ptid, tls, ctid);
+}
+
+/* Only waits without timeout and wakes are supported. */
+int
+sys_futex()
+{
+    int *uaddr, op, val;
+    void *timeout;
+    if (argu64(0, (uint64_t *) & uaddr) < 0 || argint(1, &op) < 0
+        || argint(2, &val) < 0 || argu64(3, (uint64_t *) & timeout) < 0)
+        return -1;
+
+    switch (op & ~FUTEX_PRIVATE_FLAG) {
+    case FUTEX_WAIT:
+        if (timeout) {
+            warn("timed futex wait unimplemented");
+            return -1;
+        }
+        return futex_wait(uaddr, val);
+    case FUTEX_WAKE:
+        return futex_wake(uaddr, val);
+    default:
+        warn("futex op %d unimplemented", op);
+        return -1;
+    }
+}
+
+int
+sys_set_tid_address()
+{
+    int *tidptr;
+    if (argu64(0, (uint64_t *) & tidptr) < 0)
+        return -1;
+    thisproc()->clear_tid = tidptr;
+    return thisproc()->pid;
+}
+
+/* Exit all threads of the current process. */
+int
+sys_exit_group()
+{
+    int status;
+    if (argint(0, &status) < 0)
+        return -1;
+    kill_threads(thisproc()->vm, (status & 0xff) << 8);
+    exit(status);
+    return 0;
 }
 
 
+static void
+timeval_set(struct timeval *tv, uint64_t t)
+{
+    uint64_t f = timerfreq();
+    tv->tv_sec = t / f;
+    tv->tv_usec = t % f * 1000000 / f;
+}
+
+/* Fields not accounted, e.g. ru_maxrss, are zero. */
+static void
+rusage_set(struct rusage *ru, struct usage *u)
+{
+    *ru = (struct rusage) {
+        .ru_nvcsw = u->nvcsw, .ru_nivcsw = u->nivcsw
+    };
+    timeval_set(&ru->ru_utime, u->utime);
+    timeval_set(&ru->ru_stime, u->stime);
+}
+
+/*
+ * Without process groups, pid 0 waits for any child as -1 does.
+ * Nothing ever stops, so WUNTRACED and WCONTINUED change nothing.
+ */
 int
 sys_wait4()
 {
     int pid, opt;
-    int *wstatus;
-    void *rusage;
+    uint64_t wstatus, rusage;
+    int *status = 0;
+    struct rusage *ru = 0;
     if (argint(0, &pid) < 0 ||
-        argu64(1, (uint64_t *) & wstatus) < 0 ||
-        argint(2, &opt) < 0 || argu64(3, (uint64_t *) & rusage) < 0)
+        argu64(1, &wstatus) < 0 ||
+        argint(2, &opt) < 0 || argu64(3, &rusage) < 0)
+        return -1;
+    if ((wstatus && argptr(1, (char **)&status, sizeof(*status)) < 0) ||
+        (rusage && argptr(3, (char **)&ru, sizeof(*ru)) < 0))
         return -1;
 
-    // FIXME:
-    if (pid != -1 || wstatus != 0 || opt != 0 || rusage != 0) {
-        warn("unimplemented. pid %d, wstatus 0x%p, opt 0x%x, rusage 0x%p",
-             pid, wstatus, opt, rusage);
+    if (pid < -1 || (opt & ~(WNOHANG | WUNTRACED | WCONTINUED))) {
+        warn("unimplemented. pid %d, opt 0x%x", pid, opt);
         return -1;
     }
 
-    return wait();
+    struct usage u;
+    pid = wait(pid ? pid : -1, status, opt & WNOHANG, ru ? &u : 0);
+    if (pid > 0 && ru)
+        rusage_set(ru, &u);
+    return pid;
+}
+
+/* RUSAGE_SELF only counts the calling thread, as RUSAGE_THREAD does. */
+int
+sys_getrusage()
+{
+    int who;
+    struct rusage *ru;
+    if (argint(0, &who) < 0 || argptr(1, (char **)&ru, sizeof(*ru)) < 0)
+        return -1;
+
+    struct proc *p = thisproc();
+    struct usage u;
+    if (who == RUSAGE_SELF || who == RUSAGE_THREAD) {
+        u = p->ru;
+        u.stime += timestamp() - p->tstamp;
+    } else if (who == RUSAGE_CHILDREN) {
+        u = p->cru;
+    } else {
+        return -1;
+    }
+    rusage_set(ru, &u);
+    return 0;
 }
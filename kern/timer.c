@@ -10,15 +10,19 @@
 #define CORE_TIMER_CTRL(i)      (LOCAL_BASE + 0x40 + 4*(i))
 #define CORE_TIMER_ENABLE       (1 << 1)        /* CNTPNSIRQ */
 
-static uint64_t dt;
+static uint64_t quantum;
 static uint64_t cnt;
 
+/*
+ * The timer is one-shot. It is armed by the scheduler for the deadline
+ * of the process to run and stays off while the cpu is idle, so that
+ * there is no periodic tick at all.
+ */
 void
 timer_init()
 {
-    dt = timerfreq();
-    asm volatile ("msr cntp_ctl_el0, %[x]"::[x] "r"(1));
-    asm volatile ("msr cntp_tval_el0, %[x]"::[x] "r"(dt));
+    quantum = timerfreq() / 1000 * QUANTUM_MS;
+    timer_disable();
     put32(CORE_TIMER_CTRL(cpuid()), CORE_TIMER_ENABLE);
 #ifdef USE_GIC
     irq_enable(IRQ_LOCAL_CNTPNS);
@@ -26,20 +30,37 @@ timer_init()
 #endif
 }
 
-static void
-timer_reset()
+/* Length of a time slice in timer ticks. */
+uint64_t
+timer_quantum()
+{
+    return quantum;
+}
+
+/* Fire the timer of this cpu once when the counter reaches deadline. */
+void
+timer_set(uint64_t deadline)
+{
+    asm volatile ("msr cntp_cval_el0, %[x]"::[x] "r"(deadline));
+    asm volatile ("msr cntp_ctl_el0, %[x]"::[x] "r"(1));
+}
+
+/* Stop the timer of this cpu, which also clears its pending interrupt. */
+void
+timer_disable()
 {
-    asm volatile ("msr cntp_tval_el0, %[x]"::[x] "r"(dt));
+    asm volatile ("msr cntp_ctl_el0, %[x]"::[x] "r"(0));
 }
 
 /*
  * This is a per-cpu non-stable version of clock, frequency of 
  * which is determined by cpu clock (may be tuned for power saving).
+ * The running process has used up its time slice.
  */
 void
 timer_intr()
 {
     trace("t: %d", ++cnt);
-    timer_reset();
-    yield();
+    timer_disable();
+    thiscpu()->resched = 1;
 }
@@ -8,6 +8,7 @@
 #include "memlayout.h"
 #include "console.h"
 #include "proc.h"
+#include "vm.h"
 
 #include "debug.h"
 
@@ -24,8 +25,19 @@ trap(struct trapframe *tf)
 {
     int ec = resr() >> EC_SHIFT, iss = resr() & ISS_MASK, il =
         resr() & IR_MASK;
+    struct vmspace *vm;
+    struct proc *p = thisproc();
+    uint64_t t;
     /* Clear esr. */
     lesr(0);
+
+    /* Entered from user space, where time since tstamp was spent. */
+    if (!(tf->spsr & 0xF)) {
+        t = timestamp();
+        p->ru.utime += t - p->tstamp;
+        p->tstamp = t;
+    }
+
     switch (ec) {
     case EC_UNKNOWN:
         if (il) {
@@ -36,15 +48,60 @@ trap(struct trapframe *tf)
 
     case EC_SVC64:
         if (iss == 0) {
+            uvm_sysenter(p);
             tf->x[0] = syscall1(tf);
+            uvm_sysexit(p);
         } else {
             warn("unexpected svc iss 0x%x", iss);
         }
         break;
 
+    case EC_IABORT:
+    case EC_DABORT:
+    case EC_DABORT_EL1:
+        vm = p->vm;
+        /* First touch of a user page, either by user or by kernel. */
+        if ((iss & ISS_DFSC_MASK) == ISS_DFSC_TRANS
+            && vm && uvm_fault(vm, (void *)rfar()) == 0)
+            break;
+        /* Write to a copy-on-write page. */
+        if (ec != EC_IABORT && (iss & ISS_WNR)
+            && (iss & ISS_DFSC_MASK) == ISS_DFSC_PERM && vm) {
+            acquire(&vm->lock);
+            int r = uvm_cow(vm->pgdir, (void *)rfar());
+            release(&vm->lock);
+            if (r == 0)
+                break;
+        }
+        if (ec == EC_DABORT_EL1) {
+            debug_reg();
+            panic("kernel data abort at 0x%p, iss 0x%x", rfar(), iss);
+        }
+        exit(1);
+        break;
+
     default:
+        if (tf->spsr & 0xF) {
+            debug_reg();
+            panic("unexpected exception from kernel, ec 0x%x", ec);
+        }
         exit(1);
     }
+
+    /* Killed by another thread, e.g. in exit_group(). */
+    if (p->killed && !(tf->spsr & 0xF))
+        exit(1);
+
+    /* Preempted by timer or by a process of higher priority. */
+    if (thiscpu()->resched && !(tf->spsr & 0xF))
+        yield();
+
+    /* Back to user space, see scheduler() for the time switched out. */
+    if (!(tf->spsr & 0xF)) {
+        t = timestamp();
+        p->ru.stime += t - p->tstamp;
+        p->tstamp = t;
+    }
 }
 
 void
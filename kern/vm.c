@@ -8,22 +8,82 @@
 
 #include "console.h"
 #include "mm.h"
+#include "file.h"
+#include "spinlock.h"
 
 /* For simplicity, we only support 4k pages in user pgdir. */
 
 extern uint64_t kpgdir[512];
 
+/*
+ * ASID allocator.
+ *
+ * Each user page directory is tagged with an 8-bit ASID, so that TLB
+ * entries of different processes can coexist and switching between
+ * them needs no flush. The ASID of a page directory is kept in its page
+ * descriptor, along with the generation it was allocated in (the bits
+ * above ASID_BITS). When the ASIDs of the current generation run out,
+ * a new generation starts: all ASIDs are released except the active
+ * ones, and every cpu flushes its TLB before switching to a new ASID.
+ *
+ * A switch to a page directory whose ASID is of the current generation
+ * takes no lock: it just swaps it into its slot of asid.active[] by
+ * cmpxchg. A rollover zeroes every slot by xchg, remembering the ASID
+ * in asid.reserved[], so such a cmpxchg fails if it races with one and
+ * the switch falls back to asid.lock.
+ */
+#define ASID_BITS       8
+#define NASID           (1 << ASID_BITS)
+#define ASID_MASK       (NASID - 1)
+
+static struct {
+    struct spinlock lock;
+    uint64_t gen;               /* Current generation. */
+    uint64_t used[NASID / 64];  /* Bitmap of ASIDs in current generation. */
+    uint64_t active[NCPU];      /* ASID (with generation) running on cpu. */
+    uint64_t reserved[NCPU];    /* ASID kept by cpu over the last rollover. */
+    int flush[NCPU];            /* Flush TLB on next switch? */
+
+    /* Statistics, reported by vm_dump(). */
+    uint64_t nrollover, nflush;
+} asid = {
+    .gen = NASID, .used = { 1 },
+    /*
+     * The boot identity map at low addresses is global, i.e. matches
+     * every ASID, so each cpu flushes it before its first user space.
+     * That switch never takes the fast path, as active[] is 0.
+     */
+    .flush = { [0 ... NCPU - 1] = 1 },
+};
+
 uint64_t *
 vm_init()
 {
     uint64_t *pgdir = kalloc();
-    if (pgdir)
+    if (pgdir) {
         memset(pgdir, 0, PGSIZE);
-    else
+        va2page(pgdir)->asid = 0;
+    } else
         warn("failed");
     return pgdir;
 }
 
+/*
+ * Flush TLB entries of user page table pgdir, which has been modified.
+ * Even an ASID of an old generation is flushed: one kept running over
+ * a rollover is only renewed in pg->asid on the next uvm_switch().
+ * Nothing to do if it never had one.
+ */
+static void
+uvm_flush(uint64_t * pgdir)
+{
+    uint64_t a = va2page(pgdir)->asid;
+    if (a) {
+        tlbiasid(a & ASID_MASK);
+        __atomic_add_fetch(&asid.nflush, 1, __ATOMIC_RELAXED);
+    }
+}
+
 /*
  * return the address of the pte in user page table
  * pgdir that corresponds to virtual address va.
@@ -37,8 +97,10 @@ pgdir_walk(uint64_t * pgdir, void *vap, int alloc)
         int idx = (va >> (12 + (3 - i) * 9)) & 0x1FF;
         if (!(pgt[idx] & PTE_VALID)) {
             void *p;
+            if (!alloc)
+                return 0;
             /* FIXME Free allocated pages and restore modified pgt */
-            if (alloc && (p = kalloc())) {
+            if ((p = kalloc())) {
                 memset(p, 0, PGSIZE);
                 pgt[idx] = V2P(p) | PTE_TABLE;
             } else {
@@ -51,7 +113,13 @@ pgdir_walk(uint64_t * pgdir, void *vap, int alloc)
     return &pgt[(va >> 12) & 0x1FF];
 }
 
-/* Fork a process's page table. */
+/*
+ * Fork a process's page table.
+ *
+ * User pages are not copied but shared between the two page tables.
+ * Writable pages are marked read-only and copy-on-write in both of
+ * them, and will be copied by uvm_cow() on the first write.
+ */
 uint64_t *
 uvm_copy(uint64_t * pgdir)
 {
@@ -71,51 +139,422 @@ uvm_copy(uint64_t * pgdir)
                         if (pgt2[i2] & PTE_VALID) {
                             assert(pgt2[i2] & PTE_TABLE);
                             uint64_t *pgt3 = P2V(PTE_ADDR(pgt2[i2]));
+                            /* Pages being unmapped are left out. */
                             for (int i3 = 0; i3 < 512; i3++)
-                                if (pgt3[i3] & PTE_VALID) {
+                                if ((pgt3[i3] & PTE_VALID)
+                                    && (pgt3[i3] & PTE_USER)) {
 
                                     assert(pgt3[i3] & PTE_PAGE);
-                                    assert(pgt3[i3] & PTE_USER);
                                     assert(pgt3[i3] & PTE_NORMAL);
 
                                     assert(PTE_ADDR(pgt3[i3]) < KERNBASE);
 
-                                    uint64_t pa = PTE_ADDR(pgt3[i3]);
                                     uint64_t va =
-                                        (uint64_t) i << (12 +
-                                                         9 *
-                                                         3) | (uint64_t) i1
-                                        << (12 +
-                                            9 * 2) | (uint64_t) i2 << (12 +
-                                                                       9) |
+                                        (uint64_t) i << (12 + 9 * 3) |
+                                        (uint64_t) i1 << (12 + 9 * 2) |
+                                        (uint64_t) i2 << (12 + 9) |
                                         i3 << 12;
 
-                                    void *np = kalloc();
-                                    if (np == 0) {
-                                        vm_free(newpgdir);
-                                        warn("kalloc failed");
-                                        return 0;
-                                    }
-                                    memmove(np, P2V(pa), PGSIZE);
-                                    // disb();
-                                    // Flush to memory to sync with icache.
-                                    // dccivac(P2V(pa), PGSIZE);
-                                    // disb();
-                                    if (uvm_map
-                                        (newpgdir, (void *)va, PGSIZE,
-                                         V2P((uint64_t) np)) < 0) {
+                                    uint64_t *pte =
+                                        pgdir_walk(newpgdir, (void *)va, 1);
+                                    if (pte == 0) {
                                         vm_free(newpgdir);
-                                        kfree(np);
-                                        warn("uvm_map failed");
+                                        warn("pgdir_walk failed");
                                         return 0;
                                     }
+                                    if (!(pgt3[i3] & PTE_RO))
+                                        pgt3[i3] |= PTE_RO | PTE_COW;
+                                    *pte = pgt3[i3];
+                                    page_get(P2V(PTE_ADDR(pgt3[i3])));
                                 }
                         }
                 }
         }
+
+    /* Writable entries of pgdir might have been cached. */
+    uvm_flush(pgdir);
     return newpgdir;
 }
 
+/*
+ * Resolve a write fault at user address va in pgdir.
+ * Give the faulting page table a private copy of a copy-on-write
+ * page, or just make it writable if no one else shares the page.
+ * The page table must be locked if it is shared by threads, one of
+ * which might have resolved the fault already.
+ * Return 0 on success, -1 if va is not copy-on-write or out of memory.
+ */
+int
+uvm_cow(uint64_t * pgdir, void *va)
+{
+    if ((uint64_t) va >= USERTOP)
+        return -1;
+
+    uint64_t *pte = pgdir_walk(pgdir, va, 0);
+    if (!pte || !(*pte & PTE_VALID))
+        return -1;
+    if (!(*pte & PTE_COW))
+        return (*pte & PTE_RO) || !(*pte & PTE_USER) ? -1 : 0;
+
+    void *page = P2V(PTE_ADDR(*pte));
+    if (va2page(page)->ref == 1) {
+        *pte &= ~(PTE_RO | PTE_COW);
+    } else {
+        void *np = kalloc();
+        if (np == 0) {
+            warn("kalloc failed");
+            return -1;
+        }
+        memmove(np, page, PGSIZE);
+        *pte = V2P(np) | (PTE_FLAGS(*pte) & ~PTE_RO);
+        page_put(page);
+    }
+    tlbiva(va);
+    return 0;
+}
+
+/* Put mmaptop at the bottom of the mappings, including dead ones. */
+static void
+mmap_top(struct vmspace *vm)
+{
+    vm->mmaptop = MMAPTOP;
+    for (struct vma * v = vm->mmap; v < vm->mmap + vm->nmmap; v++)
+        vm->mmaptop = MIN(vm->mmaptop, v->start);
+    for (struct vma * v = vm->dead; v < vm->dead + vm->ndead; v++)
+        vm->mmaptop = MIN(vm->mmaptop, v->start);
+}
+
+/* Allocate an empty address space. Return 0 if out of memory. */
+struct vmspace *
+vmspace_alloc()
+{
+    struct vmspace *vm = kmalloc(sizeof(*vm));
+    if (!vm)
+        return 0;
+    memset(vm, 0, sizeof(*vm));
+    if (!(vm->pgdir = vm_init())) {
+        kfree(vm);
+        return 0;
+    }
+    initlock(&vm->lock, "vmspace");
+    initseqlock(&vm->layout, "vmlayout");
+    vm->mmaptop = MMAPTOP;
+    vm->users = vm->ref = 1;
+    return vm;
+}
+
+/* Fork an address space. Return 0 if out of memory. */
+struct vmspace *
+vmspace_copy(struct vmspace *vm)
+{
+    struct vmspace *nvm = kmalloc(sizeof(*nvm));
+    if (!nvm)
+        return 0;
+
+    acquire(&vm->lock);
+    memmove(nvm, vm, sizeof(*nvm));
+    nvm->pgdir = uvm_copy(vm->pgdir);
+    release(&vm->lock);
+
+    if (!nvm->pgdir) {
+        kfree(nvm);
+        return 0;
+    }
+    initlock(&nvm->lock, "vmspace");
+    initseqlock(&nvm->layout, "vmlayout");
+    nvm->users = nvm->ref = 1;
+    nvm->nsys = nvm->ndead = 0;
+    mmap_top(nvm);
+    if (nvm->exe)
+        nvm->exe = idup(nvm->exe);
+    return nvm;
+}
+
+/*
+ * Called by each process leaving vm. The last one drops the
+ * executable, so it must be called inside a transaction.
+ */
+void
+vmspace_exit(struct vmspace *vm)
+{
+    if (__atomic_sub_fetch(&vm->users, 1, __ATOMIC_ACQ_REL) == 0
+        && vm->exe) {
+        iput(vm->exe);
+        vm->exe = 0;
+    }
+}
+
+/*
+ * Drop a reference to vm and free it with the last one. Never touches
+ * the file system, so that it can be called from a workqueue.
+ */
+void
+vmspace_put(struct vmspace *vm)
+{
+    if (__atomic_sub_fetch(&vm->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        assert(vm->users == 0);
+        vm_free(vm->pgdir);
+        kfree(vm);
+    }
+}
+
+/*
+ * The layout of an address space, i.e. base, sz, stksz and mmap, is
+ * changed with both vm->layout and vm->lock held. Thus it can be read
+ * either under vm->lock or locklessly by the seqlock.
+ */
+
+/* Return the end of the region containing va. Caller holds vm->lock. */
+static size_t
+region_end(struct vmspace *vm, size_t va)
+{
+    if (vm->base <= va && va < vm->sz)
+        return vm->sz;
+    if (USERTOP - vm->stksz <= va && va < USERTOP)
+        return USERTOP;
+    int n = MIN(vm->nmmap, NMMAP);
+    for (struct vma * v = vm->mmap; v < vm->mmap + n; v++)
+        if (v->start <= va && va < v->end)
+            return v->end;
+    return 0;
+}
+
+/*
+ * Return the end of the user region containing address va, or 0 if
+ * va is not mapped. Takes no lock.
+ */
+size_t
+uvm_region(struct vmspace *vm, size_t va)
+{
+    size_t end;
+    uint32_t s;
+    do {
+        s = read_seqbegin(&vm->layout);
+        end = region_end(vm, va);
+    } while (read_seqretry(&vm->layout, s));
+    return end;
+}
+
+/*
+ * Map the page containing user address va of vm on first touch.
+ * The page is read from the executable if it belongs to a vma, or
+ * zero-filled otherwise. Might sleep.
+ * Return 0 on success, -1 if va is not in the user space of vm.
+ */
+int
+uvm_fault(struct vmspace *vm, void *va)
+{
+    uint64_t a = ROUNDDOWN((uint64_t) va, PGSIZE);
+    if (!uvm_region(vm, a))
+        return -1;
+    uint64_t *pte = pgdir_walk(vm->pgdir, (void *)a, 0);
+    if (pte && (*pte & PTE_VALID))
+        return 0;
+
+    void *page = kalloc();
+    if (page == 0) {
+        warn("kalloc failed");
+        return -1;
+    }
+    memset(page, 0, PGSIZE);
+
+    /* The executable is kept by vm->users, which is held by caller. */
+    int file = 0;
+    for (struct vma * v = vm->vma; v < vm->vma + vm->nvma; v++) {
+        uint64_t start = MAX(a, v->start), end = MIN(a + PGSIZE, v->end);
+        if (start >= end)
+            continue;
+        if (!file) {
+            file = 1;
+            ilock_shared(vm->exe);
+        }
+        size_t n = end - start;
+        if (readi(vm->exe, page + (start - a), v->off + (start - v->start), n)
+            != n) {
+            iunlock(vm->exe);
+            kfree(page);
+            warn("readi failed");
+            return -1;
+        }
+        /* Pages that follow in the segment are likely touched soon. */
+        if (end < v->end)
+            readahead(vm->exe, (v->off + (end - v->start)) / BSIZE,
+                      MIN((v->end - end + BSIZE - 1) / BSIZE, RA_MAX));
+    }
+    if (file) {
+        iunlock(vm->exe);
+        // Flush dcache to memory so that icache can retrieve the correct one.
+        dccivac(page, PGSIZE);
+    }
+
+    /* Another thread might have mapped or unmapped it meanwhile. */
+    acquire(&vm->lock);
+    if (!region_end(vm, a) || !(pte = pgdir_walk(vm->pgdir, (void *)a, 1))) {
+        release(&vm->lock);
+        kfree(page);
+        return -1;
+    }
+    if (*pte & PTE_VALID)
+        kfree(page);
+    else
+        *pte = V2P(page) | PTE_UDATA;
+    release(&vm->lock);
+    return 0;
+}
+
+/*
+ * Map all pages of [va, va + n) in user space of vm, so that kernel
+ * can access them without faulting, e.g. while holding spinlocks.
+ * Return 0 on success, -1 on failure.
+ */
+int
+uvm_prefault(struct vmspace *vm, void *va, size_t n)
+{
+    for (void *a = ROUNDDOWN(va, PGSIZE); a < va + n; a += PGSIZE) {
+        uint64_t *pte = pgdir_walk(vm->pgdir, a, 0);
+        if ((!pte || !(*pte & PTE_VALID)) && uvm_fault(vm, a) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Return the kernel address of user address va in pgdir, or 0 if
+ * its page is not mapped yet.
+ */
+void *
+uvm_lookup(uint64_t * pgdir, void *va)
+{
+    if ((uint64_t) va >= USERTOP)
+        return 0;
+    uint64_t *pte = pgdir_walk(pgdir, va, 0);
+    if (!pte || !(*pte & PTE_VALID))
+        return 0;
+    return P2V(PTE_ADDR(*pte)) + ((uint64_t) va & (PGSIZE - 1));
+}
+
+/*
+ * Reserve len bytes of anonymous memory in vm, which are allocated
+ * top-down below MMAPTOP and zero-filled on first touch.
+ * Return the start address, or 0 if no space is left.
+ */
+void *
+uvm_mmap(struct vmspace *vm, size_t len)
+{
+    void *va = 0;
+    len = ROUNDUP(len, PGSIZE);
+    write_seqlock(&vm->layout);
+    acquire(&vm->lock);
+    if (vm->nmmap + vm->ndead < NMMAP && len && len <= vm->mmaptop
+        && vm->mmaptop - len >= ROUNDUP(vm->sz, PGSIZE)) {
+        struct vma *v = &vm->mmap[vm->nmmap++];
+        v->end = vm->mmaptop;
+        v->start = vm->mmaptop -= len;
+        v->off = 0;
+        va = (void *)v->start;
+    }
+    release(&vm->lock);
+    write_sequnlock(&vm->layout);
+    return va;
+}
+
+/* Make the pages mapped in [start, end) inaccessible to user space. */
+static void
+uvm_revoke(uint64_t * pgdir, size_t start, size_t end)
+{
+    for (size_t a = start; a < end; a += PGSIZE) {
+        uint64_t *pte = pgdir_walk(pgdir, (char *)a, 0);
+        if (pte && (*pte & PTE_VALID)) {
+            *pte &= ~PTE_USER;
+            tlbiva((void *)a);
+        }
+    }
+}
+
+/*
+ * Unmap the region [va, va + len), which must be exactly one returned
+ * by uvm_mmap(). Return 0 on success, -1 otherwise.
+ *
+ * System calls of other threads might be accessing its pages, which
+ * they checked and faulted in at the start. Then the pages are only
+ * revoked from user space, and are freed with their addresses given
+ * back once no thread is in a system call, see uvm_sysexit().
+ */
+int
+uvm_munmap(struct vmspace *vm, void *va, size_t len)
+{
+    size_t start = (size_t)va, end = start + ROUNDUP(len, PGSIZE);
+    int r = -1;
+    write_seqlock(&vm->layout);
+    acquire(&vm->lock);
+    for (struct vma * v = vm->mmap; v < vm->mmap + vm->nmmap; v++) {
+        if (v->start == start && v->end == end) {
+            *v = vm->mmap[--vm->nmmap];
+
+            /* Pairs with the fence in uvm_sysenter(). */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            int self = thisproc()->sysvm == vm;
+            if (__atomic_load_n(&vm->nsys, __ATOMIC_RELAXED) > self) {
+                uvm_revoke(vm->pgdir, start, end);
+                v = &vm->dead[vm->ndead++];
+                v->start = start;
+                v->end = end;
+            } else {
+                uvm_dealloc(vm->pgdir, start, end, start);
+            }
+
+            /* Give back space at the bottom. */
+            mmap_top(vm);
+            r = 0;
+            break;
+        }
+    }
+    release(&vm->lock);
+    write_sequnlock(&vm->layout);
+    return r;
+}
+
+/*
+ * Count p in the system calls of its address space, before it checks
+ * any user pointer.
+ */
+void
+uvm_sysenter(struct proc *p)
+{
+    struct vmspace *vm = p->sysvm = p->vm;
+    __atomic_add_fetch(&vm->nsys, 1, __ATOMIC_RELAXED);
+    /* Pairs with the fence in uvm_munmap(). */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Called when p is done with user memory of the address space it
+ * entered a system call in. The last one out frees dead mappings.
+ */
+void
+uvm_sysexit(struct proc *p)
+{
+    struct vmspace *vm = p->sysvm;
+    if (!vm)
+        return;
+    p->sysvm = 0;
+    if (__atomic_sub_fetch(&vm->nsys, 1, __ATOMIC_ACQ_REL) || !vm->ndead)
+        return;
+
+    /* Others might have entered since, and one might unmap again. */
+    write_seqlock(&vm->layout);
+    acquire(&vm->lock);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&vm->nsys, __ATOMIC_RELAXED) == 0) {
+        for (struct vma * v = vm->dead; v < vm->dead + vm->ndead; v++)
+            uvm_dealloc(vm->pgdir, v->start, v->end, v->start);
+        vm->ndead = 0;
+        mmap_top(vm);
+    }
+    release(&vm->lock);
+    write_sequnlock(&vm->layout);
+}
+
 /* Free a user page table and all the physical memory pages. */
 void
 vm_free(uint64_t * pgdir)
@@ -135,7 +574,7 @@ vm_free(uint64_t * pgdir)
                             for (int i = 0; i < 512; i++)
                                 if (pgt3[i] & PTE_VALID) {
                                     uint64_t *p = P2V(PTE_ADDR(pgt3[i]));
-                                    kfree(p);
+                                    page_put(p);
                                 }
                             kfree(pgt3);
                         }
@@ -221,28 +660,116 @@ uvm_dealloc(uint64_t * pgdir, size_t base, size_t oldsz, size_t newsz)
 
     for (size_t a = ROUNDUP(newsz, PGSIZE); a < oldsz; a += PGSIZE) {
         uint64_t *pte = pgdir_walk(pgdir, (char *)a, 0);
+        /* Pages never touched are not mapped. */
         if (pte && (*pte & PTE_VALID)) {
             uint64_t pa = PTE_ADDR(*pte);
             assert(pa);
-            kfree(P2V(pa));
             *pte = 0;
-        } else {
-            warn("attempt to free unallocated page");
+            tlbiva((void *)a);
+            page_put(P2V(pa));
         }
     }
     return newsz;
 }
 
+/* Start a new generation of ASIDs. Caller must hold asid.lock. */
+static void
+asid_rollover()
+{
+    __atomic_store_n(&asid.gen, asid.gen + NASID, __ATOMIC_RELEASE);
+    memset(asid.used, 0, sizeof(asid.used));
+    asid.used[0] = 1;           /* ASID 0 is never used. */
+
+    /*
+     * Processes running on other cpus keep their ASIDs. A cpu that
+     * has not switched since the last rollover keeps the one reserved.
+     */
+    for (int i = 0; i < NCPU; i++) {
+        uint64_t a = __atomic_exchange_n(&asid.active[i], 0,
+                                         __ATOMIC_ACQ_REL);
+        if (!a)
+            a = asid.reserved[i];
+        uint64_t x = a & ASID_MASK;
+        if (x)
+            asid.used[x / 64] |= 1UL << (x % 64);
+        asid.reserved[i] = a;
+        asid.flush[i] = 1;
+    }
+    asid.nrollover++;
+}
+
+/* Return a valid ASID for pgdir. Caller must hold asid.lock. */
+static uint64_t
+asid_get(struct page *pg)
+{
+    uint64_t a = pg->asid;
+    if ((a & ~ASID_MASK) == asid.gen)
+        return a;
+
+    /* Renew the ASID if some cpu kept it over the last rollover. */
+    int reserved = 0;
+    for (int i = 0; a && i < NCPU; i++) {
+        if (asid.reserved[i] == a) {
+            asid.reserved[i] = asid.gen | (a & ASID_MASK);
+            reserved = 1;
+        }
+    }
+    if (reserved) {
+        a = asid.gen | (a & ASID_MASK);
+        __atomic_store_n(&pg->asid, a, __ATOMIC_RELAXED);
+        return a;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < NASID / 64; i++) {
+            if (~asid.used[i]) {
+                int b = __builtin_ctzl(~asid.used[i]);
+                asid.used[i] |= 1UL << b;
+                a = asid.gen | (i * 64 + b);
+                __atomic_store_n(&pg->asid, a, __ATOMIC_RELAXED);
+                return a;
+            }
+        }
+        asid_rollover();
+    }
+    panic("no asid");
+    return 0;
+}
+
 void
 uvm_switch(uint64_t * pgdir)
 {
-    // FIXME: Use NG and ASID for efficiency.
-    lttbr0(V2P(pgdir));
+    int c = cpuid();
+    struct page *pg = va2page(pgdir);
+
+    /* Fast path, see the ASID allocator above. */
+    uint64_t a = __atomic_load_n(&pg->asid, __ATOMIC_RELAXED);
+    uint64_t old = __atomic_load_n(&asid.active[c], __ATOMIC_RELAXED);
+    if (old && (a & ~ASID_MASK) == __atomic_load_n(&asid.gen,
+                                                   __ATOMIC_ACQUIRE)
+        && __atomic_compare_exchange_n(&asid.active[c], &old, a, 0,
+                                       __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED)) {
+        lttbr0_asid(V2P(pgdir), a & ASID_MASK);
+        return;
+    }
+
+    acquire(&asid.lock);
+    a = asid_get(pg);
+    __atomic_store_n(&asid.active[c], a, __ATOMIC_RELAXED);
+    if (asid.flush[c]) {
+        asid.flush[c] = 0;
+        asid.nflush++;
+        tlbi_local();
+    }
+    release(&asid.lock);
+    lttbr0_asid(V2P(pgdir), a & ASID_MASK);
 }
 
 /*
  * Copy len bytes from p to user address va in page table pgdir.
- * Allocate physical pages if required.
+ * Allocate zero-filled physical pages if required, so a page that
+ * should hold file contents must be faulted in by caller first.
  * Most useful when pgdir is not the current page table.
  */
 int
@@ -257,11 +784,14 @@ copyout(uint64_t * pgdir, void *va, void *p, size_t len)
         pgoff = va - ROUNDDOWN(va, PGSIZE);
         if ((pte = pgdir_walk(pgdir, va, 1)) == 0)
             return -1;
+        if ((*pte & PTE_COW) && uvm_cow(pgdir, va) < 0)
+            return -1;
         if (*pte & PTE_VALID) {
             page = P2V(PTE_ADDR(*pte));
         } else {
             if ((page = kalloc()) == 0)
                 return -1;
+            memset(page, 0, PGSIZE);
             *pte = V2P(page) | PTE_UDATA;
         }
         n = MIN(PGSIZE - pgoff, len);
@@ -340,6 +870,13 @@ vm_stat(uint64_t * pgdir)
 }
 
 
+void
+vm_dump()
+{
+    cprintf("asid: generation %lld, rollover %lld, flush %lld\n",
+            asid.gen / NASID, asid.nrollover, asid.nflush);
+}
+
 void
 vm_test()
 {
@@ -360,6 +897,16 @@ vm_test()
     for (char *i = va; (void *)i < va + PGSIZE; i++) {
         assert(*i == 0xAC);
     }
+
+    /* Forked page tables share p2 until uvm_cow() copies it. */
+    void *pgdir2 = uvm_copy(pgdir);
+    assert(pgdir2 && va2page(p2)->ref == 2);
+    assert(uvm_cow(pgdir2, va) == 0 && va2page(p2)->ref == 1);
+    uvm_switch(pgdir2);
+    for (char *i = va; (void *)i < va + PGSIZE; i++) {
+        assert(*i == 0xAC);
+    }
+    vm_free(pgdir2);
     vm_free(pgdir);
     info("pass");
 #endif
@@ -0,0 +1,84 @@
+/*
+ * Per-CPU workqueues.
+ *
+ * Each cpu has a kernel thread pinned to it, which runs the work queued
+ * to that cpu in order. Work may sleep, e.g. on disk I/O, which delays
+ * later work on the same cpu but not the process that queued it.
+ */
+
+#include "workqueue.h"
+
+#include "proc.h"
+#include "spinlock.h"
+#include "console.h"
+
+static struct workqueue {
+    struct spinlock lock;
+    struct list_head works;
+    struct proc *worker;
+} wq[NCPU];
+
+static void
+worker(void *arg)
+{
+    struct workqueue *q = arg;
+    acquire(&q->lock);
+    for (;;) {
+        while (list_empty(&q->works))
+            sleep(q, &q->lock);
+        struct work *w =
+            container_of(list_front(&q->works), struct work, link);
+        list_drop(&w->link);
+        __atomic_store_n(&w->pending, 0, __ATOMIC_RELEASE);
+        release(&q->lock);
+
+        w->fn(w);
+        acquire(&q->lock);
+    }
+}
+
+void
+workqueue_init()
+{
+    for (int i = 0; i < NCPU; i++) {
+        struct workqueue *q = &wq[i];
+        char name[16] = "kworker/0";
+        name[8] += i;
+        initlock(&q->lock, "workqueue");
+        list_init(&q->works);
+        q->worker = kthread_create(worker, q, name, 1 << i);
+        assert(q->worker);
+    }
+}
+
+void
+work_init(struct work *w, void (*fn)(struct work *))
+{
+    list_init(&w->link);
+    w->fn = fn;
+    w->pending = 0;
+}
+
+/*
+ * Queue w to the worker of cpu i.
+ * Return 1 if queued and 0 if it is pending already.
+ */
+int
+work_queue_on(int i, struct work *w)
+{
+    struct workqueue *q = &wq[i];
+    if (__atomic_exchange_n(&w->pending, 1, __ATOMIC_ACQ_REL))
+        return 0;
+    acquire(&q->lock);
+    list_push_back(&q->works, &w->link);
+    wakeup(q);
+    release(&q->lock);
+    return 1;
+}
+
+/* Queue w to the worker of this cpu. */
+int
+work_queue(struct work *w)
+{
+    return work_queue_on(cpuid(), w);
+}
@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+static char buf[1 << 16];
+
+static long
+nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Read the whole file sequentially. Return the bytes read or -1. */
+static long
+readall(char *path, int bsize)
+{
+    long n, tot = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    while ((n = read(fd, buf, bsize)) > 0)
+        tot += n;
+    close(fd);
+    return n < 0 ? -1 : tot;
+}
+
+/*
+ * Measure sequential read throughput of each file, twice: the first
+ * read is served by the disk unless cached already, and the second
+ * one by the buffer cache.
+ *
+ * Usage: readbench [-b bufsize] file...
+ */
+int
+main(int argc, char *argv[])
+{
+    int i = 1, bsize = 512;
+    if (argc > 2 && !strcmp(argv[1], "-b")) {
+        bsize = atoi(argv[2]);
+        i = 3;
+    }
+    if (bsize <= 0 || bsize > sizeof(buf) || i >= argc) {
+        fprintf(stderr, "usage: %s [-b bufsize] file...\n", argv[0]);
+        return 1;
+    }
+
+    for (; i < argc; i++) {
+        for (int pass = 0; pass < 2; pass++) {
+            long t = nsec();
+            long n = readall(argv[i], bsize);
+            t = nsec() - t;
+            if (n < 0) {
+                fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i],
+                        strerror(errno));
+                break;
+            }
+            long kbs = t ? n * 1000000 / t : 0;
+            printf("%s: %ld bytes by %d, %s, %ld us, %ld.%03ld MB/s\n",
+                   argv[i], n, bsize, pass ? "cached" : "first", t / 1000,
+                   kbs / 1000, kbs % 1000);
+        }
+    }
+    return 0;
+}
@@ -2,5 +2,14 @@
 #define DEFS_H
 
 void test_fork();
+void test_kill();
+void test_wait();
+void bench_fork();
+void test_sched();
+void bench_pingpong();
+void test_thread();
+void bench_thread();
+
+long nsec();
 
 #endif
@@ -1,11 +1,23 @@
+#include <string.h>
 #include "defs.h"
 
 extern void test_fork();
 
 int
-main()
+main(int argc, char *argv[])
 {
+    /* Exec'ed by bench_fork(). */
+    if (argc > 1 && !strcmp(argv[1], "exit"))
+        return 0;
+
     test_fork();
+    test_kill();
+    test_wait();
+    test_sched();
+    test_thread();
+    bench_fork();
+    bench_pingpong();
+    bench_thread();
 
     return 0;
 }
@@ -3,7 +3,10 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <signal.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 void
 fork1()
@@ -13,12 +16,125 @@ fork1()
         exit(0);
 }
 
+/* More children than the process table used to hold. */
 void
 test_fork()
 {
-    int n = 10;
+    int n = 128;
     for (int i = 0; i < n; i++)
         fork1();
     for (int i = 0; i < n; i++)
         wait(NULL);
 }
+
+/* Kill a child blocked reading a pipe nobody writes. */
+void
+test_kill()
+{
+    int p[2];
+    char c;
+    if (pipe(p) < 0) {
+        printf("test_kill: pipe failed\n");
+        exit(1);
+    }
+    int pid = fork();
+    if (!pid) {
+        for (;;)
+            read(p[0], &c, 1);
+    }
+    if (kill(pid, 0) < 0 || kill(pid, SIGKILL) < 0 || wait(NULL) != pid) {
+        printf("test_kill: kill failed\n");
+        exit(1);
+    }
+    close(p[0]);
+    close(p[1]);
+}
+
+/*
+ * Wait for a specific child, which spins for a while in user space
+ * and exits with a status, polling with WNOHANG before it exits.
+ */
+void
+test_wait()
+{
+    int p[2], st;
+    struct rusage ru;
+    char c;
+    if (pipe(p) < 0) {
+        printf("test_wait: pipe failed\n");
+        exit(1);
+    }
+    int pid1 = fork();
+    if (!pid1) {
+        read(p[0], &c, 1);
+        for (volatile long i = 0; i < 10000000; i++);
+        exit(42);
+    }
+    int pid2 = fork();
+    if (!pid2)
+        exit(0);
+    if (waitpid(pid1, &st, WNOHANG) != 0) {
+        printf("test_wait: WNOHANG failed\n");
+        exit(1);
+    }
+    write(p[1], "x", 1);
+    if (wait4(pid1, &st, 0, &ru) != pid1 || !WIFEXITED(st)
+        || WEXITSTATUS(st) != 42) {
+        printf("test_wait: wait4 failed, status 0x%x\n", st);
+        exit(1);
+    }
+    if (ru.ru_utime.tv_sec == 0 && ru.ru_utime.tv_usec == 0) {
+        printf("test_wait: no user time\n");
+        exit(1);
+    }
+    if (waitpid(pid2, &st, 0) != pid2 || waitpid(-1, &st, WNOHANG) != -1) {
+        printf("test_wait: waitpid failed\n");
+        exit(1);
+    }
+    close(p[0]);
+    close(p[1]);
+}
+
+long
+nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Touched before fork so that the image to be forked is not tiny. */
+static char image[1 << 20];
+
+/*
+ * Measure the latency of fork+exit+wait and of fork+exec+wait,
+ * where the child execs utest itself with "exit" as argument.
+ */
+void
+bench_fork()
+{
+    int n = 100;
+    char *argv[] = { "utest", "exit", 0 };
+
+    memset(image, 1, sizeof(image));
+
+    long t = nsec();
+    for (int i = 0; i < n; i++) {
+        fork1();
+        wait(NULL);
+    }
+    t = nsec() - t;
+    printf("fork: %ld us per fork+exit+wait\n", t / n / 1000);
+
+    t = nsec();
+    for (int i = 0; i < n; i++) {
+        int pid = fork();
+        if (!pid) {
+            execve("utest", argv, 0);
+            exit(1);
+        }
+        wait(NULL);
+    }
+    t = nsec() - t;
+    printf("fork: %ld us per fork+exec+wait\n", t / n / 1000);
+}
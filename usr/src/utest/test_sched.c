@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "defs.h"
+
+/*
+ * Check nice and scheduling policy, which are set by raw system calls
+ * since musl does not wrap sched_setscheduler.
+ */
+void
+test_sched()
+{
+    struct sched_param param = { .sched_priority = 0 };
+
+    if (setpriority(PRIO_PROCESS, 0, 10) < 0
+        || getpriority(PRIO_PROCESS, 0) != 10) {
+        printf("test_sched: setpriority failed\n");
+        exit(1);
+    }
+    if (syscall(SYS_sched_setscheduler, 0, SCHED_BATCH, &param) < 0
+        || syscall(SYS_sched_getscheduler, 0) != SCHED_BATCH) {
+        printf("test_sched: sched_setscheduler failed\n");
+        exit(1);
+    }
+    syscall(SYS_sched_setscheduler, 0, SCHED_OTHER, &param);
+    setpriority(PRIO_PROCESS, 0, 0);
+
+    /* Pin to cpu 1 and back to all cpus. */
+    cpu_set_t set, old;
+    CPU_ZERO(&set);
+    CPU_SET(1, &set);
+    if (sched_getaffinity(0, sizeof(old), &old) < 0
+        || sched_setaffinity(0, sizeof(set), &set) < 0) {
+        printf("test_sched: sched_setaffinity failed\n");
+        exit(1);
+    }
+    sched_yield();
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) < 0
+        || !CPU_ISSET(1, &set) || CPU_COUNT(&set) != 1) {
+        printf("test_sched: sched_getaffinity failed\n");
+        exit(1);
+    }
+    sched_setaffinity(0, sizeof(old), &old);
+}
+
+/*
+ * Measure the round trip of a byte between two processes by a pair of
+ * pipes, which is dominated by the latency of waking up the other
+ * process when it runs on another cpu.
+ */
+void
+bench_pingpong()
+{
+    int n = 1000;
+    int p[2], q[2];
+    char c = 0;
+
+    if (pipe(p) < 0 || pipe(q) < 0) {
+        printf("pingpong: pipe failed\n");
+        exit(1);
+    }
+
+    int pid = fork();
+    if (!pid) {
+        for (int i = 0; i < n; i++) {
+            read(p[0], &c, 1);
+            write(q[1], &c, 1);
+        }
+        exit(0);
+    }
+
+    long t = nsec();
+    for (int i = 0; i < n; i++) {
+        write(p[1], &c, 1);
+        read(q[0], &c, 1);
+    }
+    t = nsec() - t;
+    wait(NULL);
+    printf("pingpong: %ld us per round trip\n", t / n / 1000);
+
+    close(p[0]);
+    close(p[1]);
+    close(q[0]);
+    close(q[1]);
+}
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "defs.h"
+
+#define NTHREAD 4
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static long counter;
+static int turn;
+
+static void *
+incr(void *arg)
+{
+    long n = (long)arg;
+    for (long i = 0; i < n; i++) {
+        pthread_mutex_lock(&lock);
+        counter++;
+        pthread_mutex_unlock(&lock);
+    }
+    return arg;
+}
+
+/* Threads share memory and are joined with their return values. */
+void
+test_thread()
+{
+    pthread_t t[NTHREAD];
+    long n = 1000;
+    void *ret;
+
+    counter = 0;
+    for (int i = 0; i < NTHREAD; i++)
+        if (pthread_create(&t[i], NULL, incr, (void *)n)) {
+            printf("test_thread: pthread_create failed\n");
+            exit(1);
+        }
+    for (int i = 0; i < NTHREAD; i++)
+        if (pthread_join(t[i], &ret) || ret != (void *)n) {
+            printf("test_thread: pthread_join failed\n");
+            exit(1);
+        }
+    if (counter != NTHREAD * n) {
+        printf("test_thread: counter %ld, expected %ld\n", counter,
+               NTHREAD * n);
+        exit(1);
+    }
+}
+
+static void *
+pong(void *arg)
+{
+    long n = (long)arg;
+    pthread_mutex_lock(&lock);
+    for (long i = 0; i < n; i++) {
+        while (turn != 1)
+            pthread_cond_wait(&cond, &lock);
+        turn = 0;
+        pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*
+ * Measure a contended mutex and the round trip between two threads
+ * passing a turn by a condition variable, both built upon futexes.
+ */
+void
+bench_thread()
+{
+    pthread_t t[NTHREAD];
+    long n = 10000;
+
+    counter = 0;
+    long ts = nsec();
+    for (int i = 0; i < NTHREAD; i++)
+        pthread_create(&t[i], NULL, incr, (void *)n);
+    for (int i = 0; i < NTHREAD; i++)
+        pthread_join(t[i], NULL);
+    ts = nsec() - ts;
+    printf("mutex: %ld ns per lock+unlock by %d threads\n",
+           ts / (NTHREAD * n), NTHREAD);
+
+    n = 1000;
+    turn = 0;
+    ts = nsec();
+    pthread_create(&t[0], NULL, pong, (void *)n);
+    pthread_mutex_lock(&lock);
+    for (long i = 0; i < n; i++) {
+        turn = 1;
+        pthread_cond_signal(&cond);
+        while (turn != 0)
+            pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    pthread_join(t[0], NULL);
+    ts = nsec() - ts;
+    printf("condvar: %ld us per round trip\n", ts / n / 1000);
+}